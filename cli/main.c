@@ -1,8 +1,13 @@
 #include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "func.h"
 #include "template.h"
 #include "version.h"
 
@@ -10,15 +15,21 @@ typedef struct {
     char* filename;
     char* tpl;
     char* data;
+    // written between the results of consecutive records
+    char* separator;
     char is_help;
     char is_version;
+    char is_ndjson;
 } args;
 
+// stream errors continue at -710
 #define ERR_PARSE_EXPECT_ARG -700
 #define ERR_PARSE_UNEXPECTED_COUNT -701
+#define ERR_WRITE_OUT -702
+#define ERR_RECORD_TRAILING -703
 
 int parse_args(int argc, char* argv[], args* out) {
-    *out = (args){.filename = NULL, .data = NULL, .tpl = NULL, .is_help = 0, .is_version = 0};
+    *out = (args){.filename = NULL, .data = NULL, .tpl = NULL, .separator = NULL, .is_help = 0, .is_version = 0, .is_ndjson = 0};
     int err = 0;
     size_t freestanding_len = 0;
     char** freestanding = malloc(argc * sizeof(char*));
@@ -34,6 +45,19 @@ int parse_args(int argc, char* argv[], args* out) {
             out->filename = argv[i];
             continue;
         }
+        if (strcmp(argv[i], "-s") == 0) {
+            i++;
+            if (i >= argc) {
+                err = ERR_PARSE_EXPECT_ARG;
+                goto cleanup;
+            }
+            out->separator = argv[i];
+            continue;
+        }
+        if (strcmp(argv[i], "--ndjson") == 0) {
+            out->is_ndjson = 1;
+            continue;
+        }
         if (strcmp(argv[i], "--help") == 0) {
             out->is_help = 1;
             continue;
@@ -58,6 +82,10 @@ int parse_args(int argc, char* argv[], args* out) {
         }
         goto cleanup;
     }
+    if (out->separator != NULL && !out->is_ndjson) {
+        err = ERR_PARSE_UNEXPECTED_COUNT;
+        goto cleanup;
+    }
     if (out->filename != NULL) {
         if (freestanding_len != 1) {
             err = ERR_PARSE_UNEXPECTED_COUNT;
@@ -77,6 +105,256 @@ cleanup:
     return err;
 }
 
+// Writes chunks of the result directly to stdout, bypassing stdio.
+// This also passes NUL bytes in the result through.
+int write_out(const char* data, size_t len, void* userdata) {
+    while (len > 0) {
+        ssize_t written = write(STDOUT_FILENO, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            *(int*)userdata = errno;
+            return ERR_WRITE_OUT;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+#define OUT_FLUSH_SIZE 65536
+
+typedef struct {
+    buf b;
+    int write_errno;
+} out_buffer;
+
+int out_buffer_flush(out_buffer* out) {
+    int err = write_out(out->b.data, out->b.len, &out->write_errno);
+    out->b.len = 0;
+    return err;
+}
+
+// Collects the results of many small records to write them in
+// few large chunks.
+int write_buffered(const char* data, size_t len, void* userdata) {
+    out_buffer* out = (out_buffer*)userdata;
+    buf_append(&out->b, data, len);
+    if (out->b.len >= OUT_FLUSH_SIZE) {
+        return out_buffer_flush(out);
+    }
+    return 0;
+}
+
+// Reads the template from args and compiles it with ctx. Prints a
+// description on failure. Returns 0 on success.
+int load_template(const args* args, template_ctx* ctx, compiled_template* compiled) {
+    stream tpl;
+    int err;
+    if (args->filename) {
+        // fall back to regular reads for files, which cannot be mapped
+        err = stream_open_mmap(&tpl, args->filename);
+        if (err) {
+            err = stream_open_file(&tpl, args->filename);
+        }
+        if (err) {
+            fprintf(stderr, "failed to open file %s: %d\n", args->filename, err);
+            return err;
+        }
+    } else {
+        stream_open_memory(&tpl, args->tpl, strlen(args->tpl));
+    }
+
+    err = template_ctx_compile(ctx, &tpl, compiled);
+    if (err) {
+        long pos = 0;
+        int st_err = stream_pos(&tpl, &pos);
+        if (st_err) {
+            fprintf(stderr, "failed to get template stream position: %d\n", st_err);
+        }
+        char* desc = template_describe_err(err);
+        if (desc == NULL) {
+            desc = "unknown error";
+        }
+        fprintf(stderr, "failed to parse template at offset %ld: %d (%s)\n", pos, err, desc);
+    }
+    int close_err = stream_close(&tpl);
+    if (close_err) {
+        fprintf(stderr, "failed to close template stream: %d\n", close_err);
+    }
+    return err;
+}
+
+// Describes err returned while reading or parsing data.
+const char* describe_data_err(int err) {
+    if (err > 0) {
+        return strerror(err);
+    }
+    if (err == ERR_STREAM_READ) {
+        return "read error";
+    }
+    const char* desc = json_describe_err(err);
+    if (desc == NULL) {
+        desc = "unknown error";
+    }
+    return desc;
+}
+
+// Prints a description of err returned while templating.
+void print_exec_err(int err, int write_errno) {
+    if (err == ERR_WRITE_OUT) {
+        fprintf(stderr, "failed to write output: %s\n", strerror(write_errno));
+        return;
+    }
+    char* desc = template_describe_err(err);
+    if (desc == NULL) {
+        desc = "unknown error";
+    }
+    fprintf(stderr, "failed to evaluate template: %d (%s)\n", err, desc);
+}
+
+// Records are separated by newlines or the record separator
+// of JSON text sequences (RFC 7464).
+#define RECORD_SEPARATOR 0x1e
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} record;
+
+// Reads the bytes up to the next separator into rec, which is reused
+// between calls. Returns EOF, if st is exhausted, or the error of
+// reading st.
+int read_record(stream* st, record* rec) {
+    rec->len = 0;
+    bool any = false;
+    const unsigned char* data;
+    size_t len;
+    int err;
+    while ((err = stream_peek(st, &data, &len)) == 0) {
+        any = true;
+        size_t n = len;
+        const unsigned char* end = memchr(data, '\n', len);
+        if (end != NULL) {
+            n = end - data;
+        }
+        end = memchr(data, RECORD_SEPARATOR, n);
+        if (end != NULL) {
+            n = end - data;
+        }
+        if (rec->len + n + 1 > rec->cap) {
+            rec->cap = (rec->len + n + 1) * 3 / 2;
+            rec->data = realloc(rec->data, rec->cap);
+            assert(rec->data);
+        }
+        memcpy(rec->data + rec->len, data, n);
+        rec->len += n;
+        if (n < len) {
+            stream_advance(st, n + 1);
+            break;
+        }
+        stream_advance(st, n);
+    }
+    if (err != 0 && err != EOF) {
+        return err;
+    }
+    if (!any) {
+        return EOF;
+    }
+    return 0;
+}
+
+bool is_blank(const char* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != ' ' && data[i] != '\t' && data[i] != '\r') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Renders compiled once per record of args->data. The record buffer,
+// the arena, ctx and the output buffer are reused for every record.
+int render_records(const args* args, template_ctx* ctx, const compiled_template* compiled) {
+    int result = EXIT_SUCCESS;
+    FILE* file = stdin;
+    if (strcmp(args->data, "-") != 0) {
+        file = fopen(args->data, "rb");
+        if (file == NULL) {
+            fprintf(stderr, "failed to open file %s: %s\n", args->data, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+    stream data;
+    stream_open_buffered(&data, file);
+    json_arena arena;
+    json_arena_init(&arena);
+    record rec = {.data = NULL, .len = 0, .cap = 0};
+    out_buffer out;
+    buf_init(&out.b);
+    out.write_errno = 0;
+    size_t count = 0;
+    size_t line = 0;
+    int err;
+    while ((err = read_record(&data, &rec)) == 0) {
+        line++;
+        if (is_blank(rec.data, rec.len)) {
+            continue;
+        }
+        stream st;
+        stream_open_memory(&st, rec.data, rec.len);
+        json_value dot;
+        json_arena_reset(&arena);
+        err = json_parse_insitu(&st, &dot, &arena);
+        if (!err && !is_blank(rec.data + st.inner.data.pos, rec.len - st.inner.data.pos)) {
+            err = ERR_RECORD_TRAILING;
+        }
+        if (err) {
+            const char* desc = describe_data_err(err);
+            if (err == ERR_RECORD_TRAILING) {
+                desc = "trailing data";
+            }
+            fprintf(stderr, "failed to parse record %zu at offset %zu: %d (%s)\n", line, st.inner.data.pos, err, desc);
+            result = EXIT_FAILURE;
+            break;
+        }
+        if (count > 0 && args->separator != NULL) {
+            buf_append(&out.b, args->separator, strlen(args->separator));
+        }
+        count++;
+        err = template_ctx_exec_to_sink(ctx, compiled, &dot, write_buffered, &out);
+        if (err) {
+            print_exec_err(err, out.write_errno);
+            result = EXIT_FAILURE;
+            break;
+        }
+    }
+    // the loop only ends without a failure once no record is left
+    if (result == EXIT_SUCCESS && err != EOF) {
+        fprintf(stderr, "failed to read record %zu: %d (%s)\n", line + 1, err, describe_data_err(err));
+        result = EXIT_FAILURE;
+    }
+    // output of the records before a failure is still written
+    err = out_buffer_flush(&out);
+    if (err && result == EXIT_SUCCESS) {
+        print_exec_err(err, out.write_errno);
+        result = EXIT_FAILURE;
+    }
+    buf_free(&out.b);
+    free(rec.data);
+    json_arena_free(&arena);
+    err = stream_close(&data);
+    if (err) {
+        fprintf(stderr, "failed to close data stream: %d\n", err);
+    }
+    if (file != stdin) {
+        fclose(file);
+    }
+    return result;
+}
+
 // The encoding of argv is operating system dependent.
 // On modern POSIX systems interactive shell input can
 // be reasonably assumed as utf-8. Neverthess, arbitrary
@@ -87,13 +365,17 @@ cleanup:
 // commandline before passing it to main() into utf-8.
 int main(int argc, char* argv[]) {
     args args;
+    // keys of untrusted JSON shall not collide predictably, the address
+    // adds entropy on systems randomizing the stack
+    hashmap_seed((uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)&args);
     int err = parse_args(argc, argv, &args);
     if (err) {
         fprintf(stderr, "invalid arguments, try cgotpl --help\n");
         return EXIT_FAILURE;
     }
     if (args.is_help) {
-        printf("usage: cgotpl ([TEMPLATE] | -f [FILENAME]) [DATA]\n");
+        printf("usage: cgotpl ([TEMPLATE] | -f [FILENAME]) ([DATA] | -)\n");
+        printf("       cgotpl ([TEMPLATE] | -f [FILENAME]) --ndjson [-s SEPARATOR] ([DATAFILE] | -)\n");
         return EXIT_SUCCESS;
     }
     if (args.is_version) {
@@ -101,66 +383,70 @@ int main(int argc, char* argv[]) {
         return EXIT_SUCCESS;
     }
 
+    compiled_template compiled;
+    template_ctx ctx;
+    if (args.is_ndjson) {
+        template_ctx_init(&ctx);
+        int result = EXIT_FAILURE;
+        if (load_template(&args, &ctx, &compiled) == 0) {
+            result = render_records(&args, &ctx, &compiled);
+            compiled_template_free(&compiled);
+        }
+        template_ctx_free(&ctx);
+        return result;
+    }
+
     int result = EXIT_SUCCESS;
     stream data;
     json_value dot = JSON_NULL;
-    char* out = NULL;
+    // the data is freed at once at exit, if it is in memory
+    json_arena arena;
+    json_arena_init(&arena);
+    bool in_arena = false;
 
-    stream_open_memory(&data, args.data, strlen(args.data));
-    err = json_parse(&data, &dot);
+    // - reads the data from stdin, which may be a pipe
+    if (strcmp(args.data, "-") == 0) {
+        stream_open_buffered(&data, stdin);
+        err = json_parse(&data, &dot);
+    } else {
+        stream_open_memory(&data, args.data, strlen(args.data));
+        // strings may reference argv, which lives until exit
+        err = json_parse_insitu(&data, &dot, &arena);
+        in_arena = true;
+    }
     if (err) {
         long pos = 0;
         int st_err = stream_pos(&data, &pos);
         if (st_err) {
             fprintf(stderr, "failed to get data stream position: %d\n", st_err);
         }
-        char* desc = json_describe_err(err);
-        if (desc == NULL) {
-            desc = "unknown error";
-        }
-        fprintf(stderr, "failed to parse data at offset %ld: %d (%s)\n", pos, err, desc);
+        fprintf(stderr, "failed to parse data at offset %ld: %d (%s)\n", pos, err, describe_data_err(err));
         result = EXIT_FAILURE;
         goto cleanup;
     }
 
-    stream tpl;
-    if (args.filename) {
-        err = stream_open_file(&tpl, args.filename);
-        if (err) {
-            fprintf(stderr, "failed to open file %s: %d\n", args.filename, err);
-            result = EXIT_FAILURE;
-            goto cleanup_json;
-        }
-    } else {
-        stream_open_memory(&tpl, args.tpl, strlen(args.tpl));
-    }
-
-    err = template_eval_stream(&tpl, &dot, &out);
+    template_ctx_init(&ctx);
+    err = load_template(&args, &ctx, &compiled);
     if (err) {
-        long pos = 0;
-        int st_err = stream_pos(&tpl, &pos);
-        if (st_err) {
-            fprintf(stderr, "failed to get template stream position: %d\n", st_err);
-        }
-        char* desc = template_describe_err(err);
-        if (desc == NULL) {
-            desc = "unknown error";
-        }
-        fprintf(stderr, "failed to evaluate template at offset %ld: %d (%s)\n", pos, err, desc);
+        template_ctx_free(&ctx);
         result = EXIT_FAILURE;
-        goto cleanup_tpl;
+        goto cleanup_json;
     }
-    printf("%s", out);
-
-cleanup_tpl:
-    err = stream_close(&tpl);
+    int write_errno = 0;
+    err = template_ctx_exec_to_sink(&ctx, &compiled, &dot, write_out, &write_errno);
+    compiled_template_free(&compiled);
+    template_ctx_free(&ctx);
     if (err) {
-        fprintf(stderr, "failed to close template stream: %d\n", err);
+        print_exec_err(err, write_errno);
+        result = EXIT_FAILURE;
     }
+
 cleanup_json:
-    json_value_free(&dot);
+    if (!in_arena) {
+        json_value_free(&dot);
+    }
 cleanup:
-    free(out);
+    json_arena_free(&arena);
     err = stream_close(&data);
     if (err) {
         fprintf(stderr, "failed to close data stream: %d\n", err);
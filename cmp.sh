@@ -61,6 +61,8 @@ testcase '{{84.25}}' 'null'
 testcase '{{ -84.25}}' 'null'
 testcase '{{ 0007.3 }}' 'null'
 testcase '{{ -0003.4 }}' 'null'
+testcase '{{ 5e-324 }}' 'null'
+testcase '{{ 1e-400 }}' 'null'
 testcase '{{/* xyz */}}' 'null'
 testcase '{{9 /* xyz */}}' 'null'
 testcase '{{/* xyz */ 9}}' 'null'
@@ -7,5 +7,8 @@
 // out needs to be at least 4 bytes
 void utf8_encode(int32_t cp, char* out, size_t* out_len);
 int32_t utf8_decode(const unsigned char* in, size_t in_len);
+// Returns the length of the longest prefix of in, which consists of
+// complete and valid utf-8 codepoints.
+size_t utf8_valid_prefix(const unsigned char* in, size_t in_len);
 
 #endif
\ No newline at end of file
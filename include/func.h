@@ -35,9 +35,10 @@ typedef struct {
 
 void tracked_value_free(tracked_value* val);
 
+struct template_expr_st;
+
 typedef struct {
-    stream* in;
-    long* args;
+    struct template_expr_st* const* args;
     size_t idx;
     size_t args_len;
     tracked_value* piped;
@@ -1,6 +1,7 @@
 #ifndef CGOTPL_JSON
 #define CGOTPL_JSON
 
+#include <stdint.h>
 #include <stdio.h>
 
 #include "map.h"
@@ -13,10 +14,14 @@
 #define JSON_TY_STRING 4
 #define JSON_TY_FALSE 5
 #define JSON_TY_TRUE 6
+// not yet decoded object or array, see json_parse_lazy
+#define JSON_TY_LAZY 7
 
 struct json_value_st;
 typedef struct json_value_st json_value;
 
+struct json_lazy_st;
+
 typedef struct {
     json_value* data;
     size_t len;
@@ -30,19 +35,73 @@ struct json_value_st {
         char* str;
         double num;
         json_array arr;
+        struct json_lazy_st* lazy;
     } inner;
 };
 
 #define JSON_NULL (json_value){.ty = 0}
 
+// maximum length of a number literal
+#define JSON_NUMBER_CAP 128
+
 #define ERR_JSON_INVALID_ESCAPE -800
 #define ERR_JSON_INVALID_SYNTAX -801
 #define ERR_JSON_BUFFER_OVERFLOW -802
 #define ERR_JSON_DEPTH_EXCEEDED -803
+#define ERR_JSON_UNSUPPORTED_STREAM -804
+
+struct json_arena_block_st;
+struct json_index_st;
+
+// Region, from which all nodes of a document parsed with
+// json_parse_arena are allocated.
+typedef struct {
+    struct json_arena_block_st* head;
+    // indexes of lazily parsed documents, released with the arena
+    struct json_index_st* docs;
+    // parse buffers kept for the next document
+    uint32_t* tokens;
+    size_t tokens_cap;
+    void* members;
+    size_t members_cap;
+    char* str;
+    size_t str_cap;
+} json_arena;
+
+void json_arena_init(json_arena* arena);
+void* json_arena_alloc(json_arena* arena, size_t n);
+// Releases everything allocated from arena, but keeps memory
+// around to parse the next document into it.
+void json_arena_reset(json_arena* arena);
+// Releases everything allocated from arena at once.
+void json_arena_free(json_arena* arena);
 
 // Consumes an abitrary amount of bytes from st to parse a single JSON value
 // into val. Returns 0 on success.
 int json_parse(stream* st, json_value* val);
+// Like json_parse, but allocates everything from arena. st needs to be
+// a memory or mmap stream of less than 4 GiB. val must not be passed to
+// json_value_free, but is released with json_arena_free. Returns 0 on success.
+int json_parse_arena(stream* st, json_value* val, json_arena* arena);
+// Like json_parse_arena, but strings without escape sequences reference
+// the data of st directly. st needs to be a memory stream over writable
+// data, which outlives val. The data is modified, even on error.
+int json_parse_insitu(stream* st, json_value* val, json_arena* arena);
+// Like json_parse_arena, but only validates the input. Objects and arrays
+// are left as JSON_TY_LAZY and decoded one level at a time by json_resolve.
+// The data of st needs to outlive val. Only the index of the document is
+// kept besides the decoded values. Returns 0 on success.
+int json_parse_lazy(stream* st, json_value* val, json_arena* arena);
+// Decodes val in place, if it is JSON_TY_LAZY. The elements of a
+// decoded object or array may still be lazy. val becomes null, if the
+// data was modified after json_parse_lazy.
+void json_resolve(json_value* val);
+// Converts the JSON number made of the digit first and rest_len < JSON_NUMBER_CAP
+// bytes of rest into out. Returns 0 on success.
+int json_number_convert(char first, const unsigned char* rest, size_t rest_len, double* out);
+// Returns the hash of key in objects to look it up repeatedly
+// with hashmap_get_hashed.
+size_t json_key_hash(const char* key);
 void json_value_copy(json_value* dest, const json_value* src);
 int json_value_equal(const json_value* a, const json_value* b);
 void json_value_free(json_value* val);
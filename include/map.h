@@ -3,9 +3,12 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct {
     bool exists;
+    // spread hash of key in larger maps
+    uint32_t hash;
     void* key;
     void* value;
 } entry;
@@ -19,6 +22,8 @@ typedef struct {
 typedef int hash_func;
 #define HASH_FUNC_IDENTITY 1
 #define HASH_FUNC_DJB2 2
+// word-at-a-time hash of wyhash, which is seeded with hashmap_seed
+#define HASH_FUNC_WYHASH 3
 
 typedef int (*hashmap_cmp)(const void*, const void*);
 typedef size_t (*hashmap_key_len)(const void*);
@@ -33,15 +38,45 @@ typedef struct {
 } hashmap;
 
 void hashmap_new(hashmap* map, hashmap_cmp cmp, hashmap_key_len key_len, hash_func hash);
+// Initializes map with len entries on hashmap_data_size(len) zeroed
+// bytes at data owned by the caller. hashmap_free must not be called
+// on such a map, if data is not allocated with malloc.
+void hashmap_init(hashmap* map, hashmap_cmp cmp, hashmap_key_len key_len, hash_func hash, entry* data, size_t len);
+// Returns the amount of entries needed to insert count keys without growing.
+// Up to 8 entries are stored packed and searched linearly.
+size_t hashmap_cap_for(size_t count);
+// Returns the bytes needed for len entries including their control bytes.
+size_t hashmap_data_size(size_t len);
+// Removes all entries, but keeps the storage.
+void hashmap_clear(hashmap* map);
 void hashmap_free(hashmap* map);
 
 // May return the previous entry stored.
 // If entry.exists is false, there wasn't a previous entry.
 entry hashmap_insert(hashmap* map, void* key, void* value);
 int hashmap_get(const hashmap* map, const void* key, const void** out);
+// Returns the hash of key in map, which can be computed once and passed
+// to the *_hashed variants for repeated inserts and lookups of key.
+size_t hashmap_hash(const hashmap* map, const void* key);
+entry hashmap_insert_hashed(hashmap* map, void* key, void* value, size_t hash);
+int hashmap_get_hashed(const hashmap* map, const void* key, size_t hash, const void** out);
 void hashmap_iter(const hashmap* map, void* userdata, void (*f)(entry*, void*));
+// Orders the entries of map by key with cmp, e.g. as go prints and
+// iterates maps. The order is kept until a key is added, so ordering
+// again is cheap. Small maps are reordered in place.
+void hashmap_order(hashmap* map);
+// Returns the entry at position idx of the order built by hashmap_order.
+entry* hashmap_ordered(const hashmap* map, size_t idx);
+// Passes storage for the order of up to cap entries, which is not freed
+// with map. Otherwise it is allocated by hashmap_order.
+void hashmap_init_order(hashmap* map, entry** storage, size_t cap);
 void** hashmap_keys(const hashmap* map);
 
+// Seeds HASH_FUNC_WYHASH, so keys colliding on purpose cannot be crafted
+// ahead of time. Needs to be called before any such map is used, as
+// hashes may be kept, e.g. by json_key_hash.
+void hashmap_seed(uint64_t seed);
+
 int hashmap_strcmp(const void* a, const void* b);
 size_t hashmap_strlen(const void* a);
 
@@ -5,8 +5,15 @@
 
 #define STREAM_MEMORY 1
 #define STREAM_FILE 2
+#define STREAM_MMAP 3
+#define STREAM_BUFFERED 4
 
 #define ERR_INVALID_UTF8 -700
+#define ERR_MMAP_UNSUPPORTED -710
+#define ERR_STREAM_READ -711
+
+#define STREAM_BUFFER_CAP 65536
+#define STREAM_LOOKBACK 4096
 
 typedef struct {
     const unsigned char* data;
@@ -14,11 +21,21 @@ typedef struct {
     size_t pos;
 } buffer;
 
+typedef struct {
+    FILE* file;
+    unsigned char* data;
+    size_t len;
+    size_t pos;
+    // stream position of data[0]
+    long offset;
+} refill_buffer;
+
 typedef struct {
     int ty;
     union {
         buffer data;
         FILE* file;
+        refill_buffer refill;
     } inner;
 } stream;
 
@@ -26,12 +43,31 @@ typedef struct {
 void stream_open_memory(stream* stream, const void* data, size_t len);
 // Opens stream on the file referenced by filename. Returns 0 on success.
 int stream_open_file(stream* stream, const char* filename);
+// Opens stream on the memory-mapped file referenced by filename.
+// Behaves like a memory stream afterwards. Returns 0 on success and
+// ERR_MMAP_UNSUPPORTED on systems without memory-mapped files.
+int stream_open_mmap(stream* stream, const char* filename);
+// Opens stream reading file through an internal buffer, which does
+// not require file to be seekable, e.g. for stdin. Seeking backwards is
+// possible by at least STREAM_LOOKBACK bytes. file is not closed by
+// stream_close.
+void stream_open_buffered(stream* stream, FILE* file);
 // Closes stream. Returns 0 on success.
 int stream_close(stream* stream);
 int stream_pos(stream* stream, long* pos);
 int stream_set_pos(stream* stream, long pos);
+// Returns EOF at the end of the stream, errno or ERR_STREAM_READ
+// if reading failed and 0 otherwise.
 int stream_read(stream* stream, unsigned char* out);
 int stream_next_utf8_cp(stream* st, unsigned char* out, size_t* len);
+// Provides the contiguous bytes following the current position in data
+// without consuming them. len is 0 for streams without a buffer to
+// peek into (STREAM_FILE), which are consumed with stream_read then.
+// Returns EOF at the end of the stream, an error as stream_read does
+// and 0 otherwise.
+int stream_peek(stream* stream, const unsigned char** data, size_t* len);
+// Consumes n bytes from the data provided by the last stream_peek.
+void stream_advance(stream* stream, size_t n);
 int stream_seek(stream* stream, size_t relative);
 
 #endif
@@ -21,16 +21,81 @@
 #define ERR_TEMPLATE_DEFINE_UNKNOWN -914
 #define ERR_TEMPLATE_DEFINE_NESTED -915
 
+struct template_node_st;
+
+typedef struct {
+    struct template_node_st* root;
+    hashmap defines;
+    // number of variable slots the root or a define needs at most
+    size_t slots;
+} compiled_template;
+
+// in is a pointer to a stream, which is read to the end. On success tpl
+// holds the compiled template, which can be executed any number of times
+// and needs to be freed with compiled_template_free. Returns 0 on success.
+int template_compile(stream* in, compiled_template* tpl);
+
+// tpl is a compiled template. dot is the inital dot value. out will be
+// filled with the result of templating and needs to be freed by the caller.
+// Returns 0 on success.
+int template_exec(const compiled_template* tpl, json_value* dot, char** out);
+
+void compiled_template_free(compiled_template* tpl);
+
+// Receives consecutive chunks of the templating result. A non-zero
+// return value aborts templating and is returned to the caller.
+typedef int (*template_write_func)(const char* data, size_t len, void* userdata);
+
+// Like template_exec, but passes the result in chunks of bounded size
+// to write instead of accumulating it. On error, parts of the result
+// may already have been written. Returns 0 on success.
+int template_exec_to_sink(const compiled_template* tpl, json_value* dot, template_write_func write, void* userdata);
+
 // in is a pointer to a stream, which may be read to the end. dot is
 // the inital dot value. out will be filled with the result of templating
 // and needs to be freed by the caller. Returns 0 on success.
 int template_eval_stream(stream* in, json_value* dot, char** out);
 
+// Like template_eval_stream, but passes the result in chunks to write
+// as described for template_exec_to_sink. Returns 0 on success.
+int template_eval_to_sink(stream* in, json_value* dot, template_write_func write, void* userdata);
+
 // tpl is a pointer to a template string from which up to n bytes are read.
 // dot is the inital dot value. out will be filled with the result of
 // templating and needs to be freed by the caller. Returns 0 on success.
 int template_eval_mem(const char* tpl, size_t n, json_value* dot, char** out);
 
+struct template_slot_st;
+
+// Holds the function table, the variable stack and the output buffer,
+// which are otherwise set up anew for every compilation or execution.
+// Their capacity is kept between the calls passed the same ctx. A ctx
+// must not be used by several calls at once.
+typedef struct {
+    hashmap funcmap;
+    struct template_slot_st* slots;
+    size_t slots_cap;
+    char* out;
+    size_t out_cap;
+} template_ctx;
+
+void template_ctx_init(template_ctx* ctx);
+void template_ctx_free(template_ctx* ctx);
+
+// Like template_compile, but uses the function table of ctx.
+int template_ctx_compile(template_ctx* ctx, stream* in, compiled_template* tpl);
+
+// Like template_exec, but out points into the buffer of ctx and
+// stays valid until ctx is passed to the next call. Returns 0 on success.
+int template_ctx_exec(template_ctx* ctx, const compiled_template* tpl, json_value* dot, const char** out);
+
+// Like template_exec_to_sink, but uses the buffers of ctx.
+int template_ctx_exec_to_sink(template_ctx* ctx, const compiled_template* tpl, json_value* dot, template_write_func write, void* userdata);
+
+// Like template_eval_mem, but out is owned by ctx as described
+// for template_ctx_exec. Returns 0 on success.
+int template_ctx_eval_mem(template_ctx* ctx, const char* tpl, size_t n, json_value* dot, const char** out);
+
 char* template_describe_err(int err);
 
 #endif
@@ -1,6 +1,7 @@
 #include "encode.h"
 
 #include <assert.h>
+#include <string.h>
 
 void utf8_encode(int32_t cp, char* out, size_t* out_len) {
     *out_len = 0;
@@ -43,3 +44,70 @@ int32_t utf8_decode(const unsigned char* in, size_t in_len) {
     assert(0);
     return 0;
 }
+
+// applies the same checks as stream_next_utf8_cp
+size_t utf8_valid_prefix(const unsigned char* in, size_t in_len) {
+    size_t i = 0;
+    while (i < in_len) {
+        // skip ascii 8 bytes at a time
+        uint64_t word;
+        while (in_len - i >= sizeof(word)) {
+            memcpy(&word, in + i, sizeof(word));
+            if (word & 0x8080808080808080ULL) {
+                break;
+            }
+            i += sizeof(word);
+        }
+        if (i == in_len) {
+            break;
+        }
+        unsigned char lead = in[i];
+        if (lead < 0x80) {
+            i++;
+            continue;
+        }
+        size_t cp_len;
+        if (0xf0 == (0xf8 & lead)) {
+            cp_len = 4;
+        } else if (0xe0 == (0xf0 & lead)) {
+            cp_len = 3;
+        } else if (0xc0 == (0xe0 & lead)) {
+            cp_len = 2;
+        } else {
+            return i;
+        }
+        if (in_len - i < cp_len) {
+            return i;
+        }
+        for (size_t j = 1; j < cp_len; j++) {
+            if (0x80 != (0xc0 & in[i + j])) {
+                return i;
+            }
+        }
+        switch (cp_len) {
+            case 4:
+                if ((0 == (0x07 & lead)) && (0 == (0x30 & in[i + 1]))) {  // overlong encoding
+                    return i;
+                }
+                if (lead == 0xf4 && in[i + 1] > 0x8f) {  // U+10FFFF exceeded
+                    return i;
+                }
+                break;
+            case 3:
+                if ((0 == (0x0f & lead)) && (0 == (0x20 & in[i + 1]))) {  // overlong encoding
+                    return i;
+                }
+                if (lead == 0xed && in[i + 1] >= 0xa0) {  // surrogate pair
+                    return i;
+                }
+                break;
+            case 2:
+                if (0 == (0x1e & lead)) {  // overlong encoding
+                    return i;
+                }
+                break;
+        }
+        i += cp_len;
+    }
+    return i;
+}
@@ -56,20 +56,162 @@ typedef struct {
 
 void sprintentry(entry* e, void* userdata);
 
+// integers up to 2^53 are exactly representable as double
+#define NUM_EXACT_MAX 9007199254740992.0
+// enough for the 17 significant digits of any double
+#define NUM_DIGITS_CAP 24
+
+// powers of ten exactly representable as double
+const double num_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// writes the decimal digits of n to out and returns their count
+size_t num_uint_digits(uint64_t n, char* out) {
+    char tmp[NUM_DIGITS_CAP];
+    size_t len = 0;
+    do {
+        tmp[len] = '0' + n % 10;
+        n /= 10;
+        len++;
+    } while (n != 0);
+    for (size_t i = 0; i < len; i++) {
+        out[i] = tmp[len - i - 1];
+    }
+    return len;
+}
+
+// Finds the shortest digits, which parse back to num > 0, as
+// num = 0.digits * 10^point. Integers and numbers with at most 22
+// fractional digits are decided with exact double arithmetic, other
+// numbers by searching the shortest round-tripping precision.
+size_t num_shortest_digits(double num, char* digits, int* point) {
+    size_t len = 0;
+    if (num < NUM_EXACT_MAX && num == trunc(num)) {
+        len = num_uint_digits((uint64_t)num, digits);
+        *point = len;
+        goto trim;
+    }
+    if (num < NUM_EXACT_MAX) {
+        for (int k = 1; k < (int)(sizeof(num_pow10) / sizeof(num_pow10[0])); k++) {
+            double scaled = num * num_pow10[k];
+            if (scaled >= NUM_EXACT_MAX) {
+                break;
+            }
+            // scaled is inexact, so the closest integer may be a neighbour
+            uint64_t guess = (uint64_t)(scaled + 0.5);
+            uint64_t found = 0;
+            int matches = 0;
+            for (uint64_t m = guess > 0 ? guess - 1 : 0; m <= guess + 1; m++) {
+                // correctly rounded like json_number_convert
+                if ((double)m / num_pow10[k] == num) {
+                    found = m;
+                    matches++;
+                }
+            }
+            if (matches > 1) {
+                break;
+            }
+            if (matches == 1) {
+                len = num_uint_digits(found, digits);
+                *point = (int)len - k;
+                goto trim;
+            }
+        }
+    }
+    char print_buf[NUM_DIGITS_CAP + 16];
+    int lo = 1;
+    int hi = 17;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        snprintf(print_buf, sizeof(print_buf), "%.*e", mid - 1, num);
+        if (strtod(print_buf, NULL) == num) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    snprintf(print_buf, sizeof(print_buf), "%.*e", lo - 1, num);
+    // print_buf is d[.ddd]e<exp>
+    const char* current = print_buf;
+    for (; *current != 'e'; current++) {
+        if (*current != '.') {
+            digits[len] = *current;
+            len++;
+        }
+    }
+    *point = atoi(current + 1) + 1;
+trim:
+    while (len > 1 && digits[len - 1] == '0') {
+        len--;
+    }
+    return len;
+}
+
+// Prints num like go's %v, i.e. the shortest representation, which
+// parses back to num, in exponent notation for exponents < -4 or >= 6.
+void sprintnum(buf* b, double num) {
+    if (isnan(num)) {
+        buf_append(b, "NaN", 3);
+        return;
+    }
+    if (isinf(num)) {
+        buf_append(b, num > 0 ? "+Inf" : "-Inf", 4);
+        return;
+    }
+    if (signbit(num)) {
+        buf_append(b, "-", 1);
+        num = -num;
+    }
+    if (num == 0) {
+        buf_append(b, "0", 1);
+        return;
+    }
+    char digits[NUM_DIGITS_CAP];
+    int point;
+    size_t len = num_shortest_digits(num, digits, &point);
+    int exp = point - 1;
+    if (exp < -4 || exp >= 6) {
+        buf_append(b, digits, 1);
+        if (len > 1) {
+            buf_append(b, ".", 1);
+            buf_append(b, digits + 1, len - 1);
+        }
+        char exp_buf[8];
+        int exp_len = snprintf(exp_buf, sizeof(exp_buf), "e%c%02d", exp < 0 ? '-' : '+', exp < 0 ? -exp : exp);
+        buf_append(b, exp_buf, exp_len);
+        return;
+    }
+    if (point <= 0) {
+        buf_append(b, "0.", 2);
+        for (int i = 0; i < -point; i++) {
+            buf_append(b, "0", 1);
+        }
+        buf_append(b, digits, len);
+        return;
+    }
+    if ((size_t)point >= len) {
+        buf_append(b, digits, len);
+        for (size_t i = len; i < (size_t)point; i++) {
+            buf_append(b, "0", 1);
+        }
+        return;
+    }
+    buf_append(b, digits, point);
+    buf_append(b, ".", 1);
+    buf_append(b, digits + point, len - point);
+}
+
 int sprintval(buf* b, json_value* val, const char* null_str) {
-    size_t expected;
-    char print_buf[128];
     const char true_str[] = "true";
     const char false_str[] = "false";
     json_array* arr;
     hashmap* obj;
+    json_resolve(val);
     switch (val->ty) {
         case JSON_TY_NUMBER:
-            expected = snprintf(print_buf, sizeof(print_buf), "%g", val->inner.num);
-            if (expected > sizeof(print_buf) - 1) {
-                return ERR_BUF_OVERFLOW;
-            }
-            buf_append(b, print_buf, expected);
+            sprintnum(b, val->inner.num);
             return 0;
         case JSON_TY_STRING:
             buf_append(b, val->inner.str, strlen(val->inner.str));
@@ -98,7 +240,10 @@ int sprintval(buf* b, json_value* val, const char* null_str) {
             obj = &val->inner.obj;
             buf_append(b, "map[", 4);
             sprintentry_data data = {.b = b, .count = 0, .len = obj->count, .null_str = null_str};
-            hashmap_iter(obj, &data, sprintentry);
+            hashmap_order(obj);
+            for (size_t i = 0; i < obj->count; i++) {
+                sprintentry(hashmap_ordered(obj, i), &data);
+            }
             buf_append(b, "]", 1);
             return 0;
     }
@@ -314,6 +459,7 @@ int func_index(template_arg_iter* iter, tracked_value* out) {
     json_value* sub = &val.val;
     for (size_t i = 1; i < args_len; i++) {
         tracked_value arg = TRACKED_NULL;
+        json_resolve(sub);
         switch (sub->ty) {
             case JSON_TY_OBJECT:
                 err = template_arg_iter_next(iter, &arg);
@@ -361,6 +507,7 @@ int func_index(template_arg_iter* iter, tracked_value* out) {
                 return ERR_FUNC_INVALID_ARG_TYPE;
         }
     }
+    json_resolve(sub);
     out->val = *sub;
     out->is_heap = false;
     tracked_value_free(&val);
@@ -866,6 +1013,7 @@ int format_value(buf* b, char specifier, json_value* val) {
     if (specifier == 'v') {
         return sprintval(b, val, NULL_STR_NIL);
     }
+    json_resolve(val);
     if (val->ty == JSON_TY_ARRAY) {
         buf_append(b, "[", 1);
         json_array arr = val->inner.arr;
@@ -884,7 +1032,10 @@ int format_value(buf* b, char specifier, json_value* val) {
     if (val->ty == JSON_TY_OBJECT) {
         buf_append(b, "map[", 4);
         format_entry_data data = {.buf = b, .idx = 0, .count = val->inner.obj.count, .specifier = specifier};
-        hashmap_iter(&val->inner.obj, &data, format_entry);
+        hashmap_order(&val->inner.obj);
+        for (size_t i = 0; i < val->inner.obj.count; i++) {
+            format_entry(hashmap_ordered(&val->inner.obj, i), &data);
+        }
         buf_append(b, "]", 1);
         return 0;
     }
@@ -897,7 +1048,11 @@ int format_value(buf* b, char specifier, json_value* val) {
         case 'F':
             return format_number(b, "%f", val);
         case 'g':
-            return format_number(b, "%g", val);
+            if (val->ty != JSON_TY_NUMBER) {
+                return format_mismatched_primitive(b, "%g", val);
+            }
+            sprintnum(b, val->inner.num);
+            return 0;
         case 'q':
             if (val->ty != JSON_TY_STRING) {
                 return format_mismatched_primitive(b, "%q", val);
@@ -1048,7 +1203,7 @@ cleanup:
 }
 
 void funcmap_new(hashmap* map) {
-    hashmap_new(map, hashmap_strcmp, hashmap_strlen, HASH_FUNC_DJB2);
+    hashmap_new(map, hashmap_strcmp, hashmap_strlen, HASH_FUNC_WYHASH);
     hashmap_insert(map, "not", func_not);
     hashmap_insert(map, "and", func_and);
     hashmap_insert(map, "or", func_or);
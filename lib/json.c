@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -16,6 +17,85 @@
 
 #define JSON_MAX_DEPTH 2048
 
+#define JSON_ARENA_ALIGN 16
+#define JSON_ARENA_BLOCK_CAP 65536
+
+struct json_arena_block_st {
+    struct json_arena_block_st* prev;
+    size_t len;
+    size_t cap;
+};
+
+// keeps the data following the block header aligned
+#define JSON_ARENA_HEADER_SIZE ((sizeof(json_arena_block) + JSON_ARENA_ALIGN - 1) & ~(size_t)(JSON_ARENA_ALIGN - 1))
+
+typedef struct json_arena_block_st json_arena_block;
+
+void json_arena_init(json_arena* arena) {
+    *arena = (json_arena){
+        .head = NULL,
+        .docs = NULL,
+        .tokens = NULL,
+        .tokens_cap = 0,
+        .members = NULL,
+        .members_cap = 0,
+        .str = NULL,
+        .str_cap = 0,
+    };
+}
+
+void* json_arena_alloc(json_arena* arena, size_t n) {
+    n = (n + JSON_ARENA_ALIGN - 1) & ~(size_t)(JSON_ARENA_ALIGN - 1);
+    json_arena_block* head = arena->head;
+    if (head == NULL || head->cap - head->len < n) {
+        size_t cap = n > JSON_ARENA_BLOCK_CAP ? n : JSON_ARENA_BLOCK_CAP;
+        head = malloc(JSON_ARENA_HEADER_SIZE + cap);
+        assert(head);
+        head->prev = arena->head;
+        head->len = 0;
+        head->cap = cap;
+        arena->head = head;
+    }
+    void* out = (unsigned char*)head + JSON_ARENA_HEADER_SIZE + head->len;
+    head->len += n;
+    return out;
+}
+
+void json_arena_free_blocks(json_arena* arena) {
+    while (arena->head != NULL) {
+        json_arena_block* prev = arena->head->prev;
+        free(arena->head);
+        arena->head = prev;
+    }
+}
+
+void json_arena_release_docs(json_arena* arena);
+
+void json_arena_reset(json_arena* arena) {
+    json_arena_release_docs(arena);
+    if (arena->head == NULL) {
+        return;
+    }
+    // keep the latest block, so a similar document fits without allocating
+    json_arena_block* head = arena->head;
+    arena->head = head->prev;
+    json_arena_free_blocks(arena);
+    head->prev = NULL;
+    head->len = 0;
+    arena->head = head;
+}
+
+void json_arena_free(json_arena* arena) {
+    json_arena_release_docs(arena);
+    json_arena_free_blocks(arena);
+    free(arena->tokens);
+    arena->tokens = NULL;
+    free(arena->members);
+    arena->members = NULL;
+    free(arena->str);
+    arena->str = NULL;
+}
+
 void json_array_free(json_array* arr) {
     for (size_t i = 0; i < arr->len; i++) {
         json_value_free(arr->data + i);
@@ -51,6 +131,13 @@ void json_value_free(json_value* val) {
     }
 }
 
+size_t json_key_hash(const char* key) {
+    // every object is created with these parameters
+    hashmap obj;
+    hashmap_init(&obj, hashmap_strcmp, hashmap_strlen, HASH_FUNC_WYHASH, NULL, 0);
+    return hashmap_hash(&obj, key);
+}
+
 void json_value_copy_iter(entry* entry, void* userdata) {
     hashmap* dest = (hashmap*)userdata;
     char* key = strdup(entry->key);
@@ -61,6 +148,7 @@ void json_value_copy_iter(entry* entry, void* userdata) {
 }
 
 void json_value_copy(json_value* dest, const json_value* src) {
+    json_value resolved;
     dest->ty = src->ty;
     switch (src->ty) {
         case JSON_TY_NULL:
@@ -84,14 +172,26 @@ void json_value_copy(json_value* dest, const json_value* src) {
             }
             return;
         case JSON_TY_OBJECT:
-            hashmap_new(&dest->inner.obj, hashmap_strcmp, hashmap_strlen, HASH_FUNC_DJB2);
+            hashmap_new(&dest->inner.obj, hashmap_strcmp, hashmap_strlen, HASH_FUNC_WYHASH);
             hashmap_iter(&src->inner.obj, &dest->inner.obj, json_value_copy_iter);
             return;
+        case JSON_TY_LAZY:
+            // copies own their memory, so decode before copying
+            resolved = *src;
+            json_resolve(&resolved);
+            json_value_copy(dest, &resolved);
+            return;
     }
     assert(0);
 }
 
-int json_value_equal(const json_value* a, const json_value* b) {
+int json_value_equal(const json_value* a_val, const json_value* b_val) {
+    json_value a_copy = *a_val;
+    json_value b_copy = *b_val;
+    json_resolve(&a_copy);
+    json_resolve(&b_copy);
+    const json_value* a = &a_copy;
+    const json_value* b = &b_copy;
     if (a->ty != b->ty) {
         return 0;
     }
@@ -126,8 +226,7 @@ int json_value_equal(const json_value* a, const json_value* b) {
                 int found = hashmap_get(&a->inner.obj, keys[i], (const void**)&aval);
                 assert(found);
                 found = hashmap_get(&b->inner.obj, keys[i], (const void**)&bval);
-                assert(found);
-                if (!json_value_equal(aval, bval)) {
+                if (!found || !json_value_equal(aval, bval)) {
                     free(keys);
                     return 0;
                 }
@@ -151,19 +250,65 @@ void json_str_append(char val, char** buf, size_t* len, size_t* cap) {
     return;
 }
 
+void json_str_append_n(const unsigned char* val, size_t n, char** buf, size_t* len, size_t* cap) {
+    while (*len + n > *cap) {
+        *cap = *cap * 3 / 2;
+        *buf = realloc(*buf, *cap);
+        assert(*buf);
+    }
+    memcpy(*buf + *len, val, n);
+    *len += n;
+}
+
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_HIGHS 0x8080808080808080ULL
+// non-zero if a byte of x is less than n, with n <= 128
+#define SWAR_HAS_LESS(x, n) (((x) - SWAR_ONES * (n)) & ~(x) & SWAR_HIGHS)
+
+// Returns the length of the prefix of data, which can be copied
+// into a string as is, i.e. up to the first quotation mark,
+// backslash or control character.
+size_t json_str_plain_len(const unsigned char* data, size_t len) {
+    size_t i = 0;
+    uint64_t word;
+    while (len - i >= sizeof(word)) {
+        memcpy(&word, data + i, sizeof(word));
+        if (SWAR_HAS_LESS(word ^ (SWAR_ONES * '"'), 1) || SWAR_HAS_LESS(word ^ (SWAR_ONES * '\\'), 1) || SWAR_HAS_LESS(word, 0x20)) {
+            break;
+        }
+        i += sizeof(word);
+    }
+    while (i < len && data[i] >= 0x20 && data[i] != '"' && data[i] != '\\') {
+        i++;
+    }
+    return i;
+}
+
 // the leading quotation mark was just read
 // will consume the trailing quotation mark
-int json_parse_str(stream* st, char** out, size_t* out_cap) {
-    size_t out_len = 0;
-    *out_cap = 32;
-    *out = malloc(*out_cap);
+// appends the NUL-terminated string to out, which holds out_len
+// bytes and has a capacity of out_cap > 0 bytes
+int json_parse_str_append(stream* st, char** out, size_t* out_len_ptr, size_t* out_cap) {
+    size_t out_len = *out_len_ptr;
 
     unsigned char cp[4];
     size_t cp_len;
     int escaped = false;
     int err = 0;
     unsigned char escaped_cp[5];
+    const unsigned char* span;
+    size_t span_len;
     while (true) {
+        if (!escaped) {
+            // copy a run of valid unescaped utf-8 in one go
+            err = stream_peek(st, &span, &span_len);
+            if (err) {
+                goto cleanup;
+            }
+            size_t n = utf8_valid_prefix(span, json_str_plain_len(span, span_len));
+            json_str_append_n(span, n, out, &out_len, out_cap);
+            stream_advance(st, n);
+        }
         err = stream_next_utf8_cp(st, cp, &cp_len);
         if (err) {
             goto cleanup;
@@ -248,7 +393,18 @@ int json_parse_str(stream* st, char** out, size_t* out_cap) {
 cleanup:
     if (err == 0) {
         json_str_append(0, out, &out_len, out_cap);
-    } else {
+    }
+    *out_len_ptr = out_len;
+    return err;
+}
+
+int json_parse_str(stream* st, char** out, size_t* out_cap) {
+    size_t out_len = 0;
+    *out_cap = 32;
+    *out = malloc(*out_cap);
+    assert(*out);
+    int err = json_parse_str_append(st, out, &out_len, out_cap);
+    if (err) {
         free(*out);
         *out = NULL;
     }
@@ -260,19 +416,138 @@ bool json_is_terminal(char c) {
 }
 
 #define JSON_NO_LAST_CHAR 0
+// up to 19 decimal digits always fit into an uint64_t
+#define JSON_NUMBER_DIGITS_MAX 19
+// integers up to 2^53 are exactly representable as double
+#define JSON_NUMBER_EXACT_MAX (UINT64_C(1) << 53)
+
+// powers of ten exactly representable as double
+const double json_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+bool json_is_digit(unsigned char c) {
+    return c >= '0' && c <= '9';
+}
+
+// returns the length of the prefix of data, which may be part of a number
+size_t json_number_span_len(const unsigned char* data, size_t len) {
+    size_t i = 0;
+    while (i < len && (json_is_digit(data[i]) || data[i] == '.' || data[i] == 'e' || data[i] == 'E' || data[i] == '+' || data[i] == '-')) {
+        i++;
+    }
+    return i;
+}
+
+// Converts the positive number starting with the digit first followed by
+// rest of rest_len < JSON_NUMBER_CAP bytes, which need to form a complete
+// JSON number. Up to 19 significant digits with a decimal exponent of at
+// most 22 are converted exactly using a single rounding operation. Only
+// otherwise strtod is called.
+int json_number_convert(char first, const unsigned char* rest, size_t rest_len, double* out) {
+    uint64_t mantissa = first - '0';
+    size_t digits = mantissa != 0;
+    int exp10 = 0;
+    size_t i = 0;
+    if (first == '0' && i < rest_len && json_is_digit(rest[i])) {
+        return ERR_JSON_INVALID_SYNTAX;
+    }
+    for (; i < rest_len && json_is_digit(rest[i]); i++) {
+        if (digits < JSON_NUMBER_DIGITS_MAX) {
+            mantissa = mantissa * 10 + (rest[i] - '0');
+        }
+        digits += mantissa != 0;
+    }
+    if (i < rest_len && rest[i] == '.') {
+        i++;
+        size_t start = i;
+        for (; i < rest_len && json_is_digit(rest[i]); i++) {
+            if (digits < JSON_NUMBER_DIGITS_MAX) {
+                mantissa = mantissa * 10 + (rest[i] - '0');
+                exp10--;
+            }
+            digits += mantissa != 0;
+        }
+        if (i == start) {
+            return ERR_JSON_INVALID_SYNTAX;
+        }
+    }
+    if (i < rest_len && (rest[i] == 'e' || rest[i] == 'E')) {
+        i++;
+        bool negative = false;
+        if (i < rest_len && (rest[i] == '+' || rest[i] == '-')) {
+            negative = rest[i] == '-';
+            i++;
+        }
+        size_t start = i;
+        int exp = 0;
+        for (; i < rest_len && json_is_digit(rest[i]); i++) {
+            // larger exponents are out of range anyway
+            if (exp < 100000) {
+                exp = exp * 10 + (rest[i] - '0');
+            }
+        }
+        if (i == start) {
+            return ERR_JSON_INVALID_SYNTAX;
+        }
+        exp10 += negative ? -exp : exp;
+    }
+    if (i != rest_len) {
+        return ERR_JSON_INVALID_SYNTAX;
+    }
+    if (mantissa == 0) {
+        *out = 0;
+        return 0;
+    }
+    int max_exp = sizeof(json_pow10) / sizeof(json_pow10[0]) - 1;
+    if (digits <= JSON_NUMBER_DIGITS_MAX && mantissa <= JSON_NUMBER_EXACT_MAX && exp10 >= -max_exp && exp10 <= max_exp) {
+        // both operands are exact, so the result is correctly rounded
+        if (exp10 < 0) {
+            *out = (double)mantissa / json_pow10[-exp10];
+        } else {
+            *out = (double)mantissa * json_pow10[exp10];
+        }
+        return 0;
+    }
+    char buf[JSON_NUMBER_CAP];
+    buf[0] = first;
+    memcpy(buf + 1, rest, rest_len);
+    buf[rest_len + 1] = 0;
+    errno = 0;
+    *out = strtod(buf, NULL);
+    // underflowing to a denormal or zero is fine
+    if (errno == ERANGE && isinf(*out)) {
+        return ERR_JSON_INVALID_SYNTAX;
+    }
+    return 0;
+}
 
 int json_parse_pos_number(stream* st, char first, double* out, char* last) {
     unsigned char cp[4];
     size_t cp_len;
-    char buf[128];
+    char buf[JSON_NUMBER_CAP];
+    int err;
     buf[0] = first;
     if (first < '0' || first > '9') {
         return ERR_JSON_INVALID_SYNTAX;
     }
+    // convert numbers followed by a terminal in the current span in place
+    const unsigned char* span;
+    size_t span_len;
+    if (stream_peek(st, &span, &span_len) == 0) {
+        size_t n = json_number_span_len(span, span_len);
+        // invalid numbers take the slow path to fail at the same offset
+        if (n < span_len && n < sizeof(buf) - 1 && json_is_terminal(span[n]) && json_number_convert(first, span, n, out) == 0) {
+            *last = span[n];
+            stream_advance(st, n + 1);
+            return 0;
+        }
+    }
     size_t buf_idx = 1;
     if (first == '0') {
         *out = 0;
-        int err = stream_next_utf8_cp(st, cp, &cp_len);
+        err = stream_next_utf8_cp(st, cp, &cp_len);
         if (err == EOF) {
             *last = JSON_NO_LAST_CHAR;
             return 0;
@@ -294,7 +569,7 @@ int json_parse_pos_number(stream* st, char first, double* out, char* last) {
         buf_idx++;
     }
     while (buf_idx < sizeof(buf)) {
-        int err = stream_next_utf8_cp(st, cp, &cp_len);
+        err = stream_next_utf8_cp(st, cp, &cp_len);
         if (err == EOF) {
             cp[0] = JSON_NO_LAST_CHAR;
             goto finish;
@@ -336,18 +611,10 @@ int json_parse_pos_number(stream* st, char first, double* out, char* last) {
     }
     return ERR_JSON_BUFFER_OVERFLOW;
 finish:
-    if (buf[buf_idx - 1] == '.') {
-        return ERR_JSON_INVALID_SYNTAX;
-    }
-    buf[buf_idx] = 0;
-    char* end;
-    *out = strtod(buf, &end);
-    if (errno == ERANGE) {
-        errno = 0;
-        return ERR_JSON_INVALID_SYNTAX;
-    }
-    if (buf_idx != end - buf) {
-        return ERR_JSON_INVALID_SYNTAX;
+    // an array must not mistake an invalid last element for its end
+    err = json_number_convert(buf[0], (const unsigned char*)buf + 1, buf_idx - 1, out);
+    if (err) {
+        return err;
     }
     *last = cp[0];
     return 0;
@@ -355,8 +622,19 @@ finish:
 
 // out needs to be at least 4 bytes long
 int json_skip_whitespace(stream* st, unsigned char* out, size_t* out_len) {
+    const unsigned char* span;
+    size_t span_len;
     while (true) {
-        int err = stream_next_utf8_cp(st, out, out_len);
+        int err = stream_peek(st, &span, &span_len);
+        if (err) {
+            return err;
+        }
+        size_t n = 0;
+        while (n < span_len && (span[n] == 0x20 || span[n] == 0x09 || span[n] == 0x0a || span[n] == 0x0d)) {
+            n++;
+        }
+        stream_advance(st, n);
+        err = stream_next_utf8_cp(st, out, out_len);
         if (err) {
             return err;
         }
@@ -370,7 +648,7 @@ int json_skip_whitespace(stream* st, unsigned char* out, size_t* out_len) {
     }
 }
 
-int json_match_ascii(stream* st, char* expected, size_t len) {
+int json_match_ascii(stream* st, const char* expected, size_t len) {
     unsigned char cp[4];
     size_t cp_len;
     for (size_t i = 0; i < len; i++) {
@@ -463,7 +741,7 @@ int json_parse_object(stream* st, hashmap* obj, size_t* depth) {
     size_t cp_len;
     char* key = NULL;
     char last_char;
-    hashmap_new(obj, hashmap_strcmp, hashmap_strlen, HASH_FUNC_DJB2);
+    hashmap_new(obj, hashmap_strcmp, hashmap_strlen, HASH_FUNC_WYHASH);
     (*depth)++;
     if (*depth > JSON_MAX_DEPTH) {
         err = ERR_JSON_DEPTH_EXCEEDED;
@@ -595,6 +873,622 @@ int json_parse_value(stream* st, json_value* val, char* last_char, size_t* depth
     return 0;
 }
 
+// The indexed parser backs the arena modes for memory-backed input. The
+// element count of an array or object is known before it is allocated,
+// so nodes are allocated exactly once. It works in two stages. First
+// the offsets of all structural characters, strings and literals of a
+// single value are collected. Then the tree is built from these offsets
+// without rescanning whitespace or string contents for structure.
+typedef struct {
+    // NULL for array elements
+    char* key;
+    // hash of key
+    size_t hash;
+    json_value val;
+} json_member;
+
+// token offsets are 32 bit to halve the size of the index
+#define JSON_INDEX_MAX_LEN UINT32_MAX
+
+typedef struct json_index_st {
+    const unsigned char* data;
+    size_t len;
+    uint32_t* tokens;
+    size_t tokens_len;
+    size_t tokens_cap;
+    // index of the next token to consume
+    size_t next;
+    // offset after the last consumed token
+    size_t end;
+    json_arena* arena;
+    // elements of the arrays and objects currently parsed
+    json_member* members;
+    size_t members_len;
+    size_t members_cap;
+    // holds strings while they are parsed into the arena
+    char* str;
+    size_t str_cap;
+    // writable alias of data, if strings may reference it
+    char* insitu;
+    // object keys seen so far, so repeated keys share
+    // a single string and are hashed only once
+    hashmap keys;
+    // only checks the input without building values
+    bool validate;
+    // leaves nested objects and arrays as JSON_TY_LAZY
+    bool lazy;
+    // previous lazy document of the arena
+    struct json_index_st* prev_doc;
+} json_index;
+
+struct json_lazy_st {
+    json_index* doc;
+    // index of the opening token
+    size_t token;
+    bool resolved;
+    json_value val;
+};
+
+typedef struct json_lazy_st json_lazy;
+
+#define JSON_INDEX_DEFAULT_CAP 64
+
+void json_index_push(json_index* idx, size_t pos) {
+    if (idx->tokens_len == idx->tokens_cap) {
+        idx->tokens_cap = idx->tokens_cap * 3 / 2;
+        idx->tokens = realloc(idx->tokens, idx->tokens_cap * sizeof(uint32_t));
+        assert(idx->tokens);
+    }
+    idx->tokens[idx->tokens_len] = (uint32_t)pos;
+    idx->tokens_len++;
+}
+
+bool json_is_delimiter(unsigned char c) {
+    return json_is_terminal(c) || c == '{' || c == '[' || c == ':' || c == '"';
+}
+
+// returns the offset of the quotation mark ending the string
+// starting at pos, or len if it is unterminated
+size_t json_index_skip_str(const unsigned char* data, size_t len, size_t pos) {
+    while (pos < len) {
+        uint64_t word;
+        while (len - pos >= sizeof(word)) {
+            memcpy(&word, data + pos, sizeof(word));
+            if (SWAR_HAS_LESS(word ^ (SWAR_ONES * '"'), 1) || SWAR_HAS_LESS(word ^ (SWAR_ONES * '\\'), 1)) {
+                break;
+            }
+            pos += sizeof(word);
+        }
+        if (pos == len) {
+            break;
+        }
+        if (data[pos] == '"') {
+            return pos;
+        }
+        if (data[pos] == '\\') {
+            pos++;
+        }
+        pos++;
+    }
+    return len;
+}
+
+// stage one: indexes tokens until the first value is complete
+void json_index_build(json_index* idx) {
+    size_t depth = 0;
+    size_t pos = 0;
+    while (pos < idx->len) {
+        unsigned char c = idx->data[pos];
+        switch (c) {
+            case 0x20:
+            case 0x09:
+            case 0x0a:
+            case 0x0d:
+                pos++;
+                // indentation usually is a run of spaces
+                while (pos < idx->len && idx->data[pos] == 0x20) {
+                    pos++;
+                }
+                continue;
+            case '{':
+            case '[':
+                json_index_push(idx, pos);
+                depth++;
+                pos++;
+                continue;
+            case '}':
+            case ']':
+                json_index_push(idx, pos);
+                pos++;
+                if (depth <= 1) {
+                    return;
+                }
+                depth--;
+                continue;
+            case ':':
+            case ',':
+                json_index_push(idx, pos);
+                pos++;
+                continue;
+            case '"':
+                json_index_push(idx, pos);
+                pos = json_index_skip_str(idx->data, idx->len, pos + 1) + 1;
+                break;
+            default:  // literal
+                json_index_push(idx, pos);
+                pos++;
+                while (pos < idx->len && !json_is_delimiter(idx->data[pos])) {
+                    pos++;
+                }
+                break;
+        }
+        if (depth == 0) {
+            return;
+        }
+    }
+}
+
+int json_index_value(json_index* idx, json_value* val, size_t* depth);
+
+// Parses the string at pos. out either references
+// the data in place or idx->str, which holds len bytes including NUL
+// and is reused for the next string.
+int json_index_str_scratch(json_index* idx, size_t pos, char** out, size_t* len) {
+    if (idx->insitu != NULL) {
+        // reference strings without escapes in place by replacing
+        // the trailing quotation mark with NUL
+        const unsigned char* start = idx->data + pos + 1;
+        size_t rest = idx->len - pos - 1;
+        size_t n = utf8_valid_prefix(start, json_str_plain_len(start, rest));
+        if (n < rest && start[n] == '"') {
+            idx->insitu[pos + 1 + n] = 0;
+            *out = idx->insitu + pos + 1;
+            *len = n + 1;
+            idx->end = pos + n + 2;
+            return 0;
+        }
+    }
+    stream st;
+    stream_open_memory(&st, idx->data + pos + 1, idx->len - pos - 1);
+    *len = 0;
+    int err = json_parse_str_append(&st, &idx->str, len, &idx->str_cap);
+    *out = idx->str;
+    idx->end = pos + 1 + st.inner.data.pos;
+    return err;
+}
+
+int json_index_str(json_index* idx, size_t pos, char** out) {
+    size_t len;
+    int err = json_index_str_scratch(idx, pos, out, &len);
+    if (idx->validate) {
+        *out = NULL;
+        return err;
+    }
+    if (!err && *out == idx->str) {
+        *out = json_arena_alloc(idx->arena, len);
+        memcpy(*out, idx->str, len);
+    }
+    return err;
+}
+
+// like json_index_str, but interns keys
+int json_index_key(json_index* idx, size_t pos, char** out, size_t* hash) {
+    char* key;
+    size_t len;
+    int err = json_index_str_scratch(idx, pos, &key, &len);
+    if (err || idx->validate) {
+        *out = NULL;
+        return err;
+    }
+    if (idx->lazy) {
+        // objects are decoded one at a time, so there is nothing to share
+        *hash = json_key_hash(key);
+        *out = json_arena_alloc(idx->arena, len);
+        memcpy(*out, key, len);
+        return 0;
+    }
+    *hash = hashmap_hash(&idx->keys, key);
+    if (hashmap_get_hashed(&idx->keys, key, *hash, (const void**)out)) {
+        return 0;
+    }
+    if (key == idx->str) {
+        *out = json_arena_alloc(idx->arena, len);
+        memcpy(*out, key, len);
+    } else {
+        *out = key;
+    }
+    hashmap_insert_hashed(&idx->keys, *out, *out, *hash);
+    return 0;
+}
+
+int json_index_number(json_index* idx, size_t pos, double* out) {
+    stream st;
+    stream_open_memory(&st, idx->data + pos, idx->len - pos);
+    // every token has at least one character
+    unsigned char first = idx->data[pos];
+    stream_advance(&st, 1);
+    int err = 0;
+    bool negative = first == '-';
+    if (negative) {
+        err = stream_read(&st, &first);
+    }
+    char last;
+    if (!err) {
+        err = json_parse_pos_number(&st, first, out, &last);
+    }
+    if (err) {
+        idx->end = pos + st.inner.data.pos;
+        return err;
+    }
+    if (negative) {
+        *out *= -1;
+    }
+    idx->end = pos + st.inner.data.pos;
+    if (last != JSON_NO_LAST_CHAR) {
+        idx->end--;
+    }
+    return 0;
+}
+
+// reports an unexpected token at pos like the streaming parser,
+// which consumes its character before failing
+int json_index_unexpected(json_index* idx, size_t pos) {
+    stream st;
+    stream_open_memory(&st, idx->data + pos, idx->len - pos);
+    unsigned char cp[4];
+    size_t cp_len;
+    int err = stream_next_utf8_cp(&st, cp, &cp_len);
+    idx->end = pos + st.inner.data.pos;
+    return err ? err : ERR_JSON_INVALID_SYNTAX;
+}
+
+int json_index_literal(json_index* idx, size_t pos, const char* expected, size_t len, size_t depth) {
+    if (idx->len - pos < len || memcmp(idx->data + pos, expected, len) != 0) {
+        // match again to fail at the same offset as the streaming parser
+        stream st;
+        stream_open_memory(&st, idx->data + pos + 1, idx->len - pos - 1);
+        int err = json_match_ascii(&st, expected + 1, len - 1);
+        idx->end = pos + 1 + st.inner.data.pos;
+        return err;
+    }
+    // like the streaming parser ignore anything following a top-level value
+    if (depth > 0 && pos + len < idx->len && !json_is_delimiter(idx->data[pos + len])) {
+        return json_index_unexpected(idx, pos + len);
+    }
+    idx->end = pos + len;
+    return 0;
+}
+
+// returns the character of the next token
+int json_index_next(json_index* idx, unsigned char* out, size_t* pos) {
+    if (idx->next == idx->tokens_len) {
+        // the streaming parser consumes the trailing whitespace
+        idx->end = idx->len;
+        return EOF;
+    }
+    *pos = idx->tokens[idx->next];
+    *out = idx->data[*pos];
+    idx->next++;
+    return 0;
+}
+
+void json_index_push_member(json_index* idx, char* key, size_t hash, const json_value* val) {
+    if (idx->members_len == idx->members_cap) {
+        idx->members_cap = idx->members_cap * 3 / 2;
+        idx->members = realloc(idx->members, idx->members_cap * sizeof(json_member));
+        assert(idx->members);
+    }
+    idx->members[idx->members_len] = (json_member){.key = key, .hash = hash, .val = *val};
+    idx->members_len++;
+}
+
+int json_index_array(json_index* idx, json_array* arr, size_t* depth) {
+    unsigned char c;
+    size_t pos;
+    int err = 0;
+    size_t start = idx->members_len;
+    *arr = (json_array){.data = NULL, .len = 0, .cap = 0};
+    (*depth)++;
+    if (*depth > JSON_MAX_DEPTH) {
+        idx->end = idx->tokens[idx->next - 1] + 1;
+        err = ERR_JSON_DEPTH_EXCEEDED;
+        goto cleanup;
+    }
+    if (idx->next < idx->tokens_len && idx->data[idx->tokens[idx->next]] == ']') {
+        idx->end = idx->tokens[idx->next] + 1;
+        idx->next++;
+        goto cleanup;
+    }
+    while (true) {
+        json_value val;
+        err = json_index_value(idx, &val, depth);
+        if (err) {
+            goto cleanup;
+        }
+        if (!idx->validate) {
+            json_index_push_member(idx, NULL, 0, &val);
+        }
+        err = json_index_next(idx, &c, &pos);
+        if (err) {
+            goto cleanup;
+        }
+        if (c == ']') {
+            idx->end = pos + 1;
+            break;
+        }
+        if (c != ',') {
+            err = json_index_unexpected(idx, pos);
+            goto cleanup;
+        }
+    }
+    if (idx->validate) {
+        goto cleanup;
+    }
+    // the element count is known now, so allocate exactly once
+    arr->len = idx->members_len - start;
+    arr->cap = arr->len;
+    arr->data = json_arena_alloc(idx->arena, arr->len * sizeof(json_value));
+    for (size_t i = 0; i < arr->len; i++) {
+        arr->data[i] = idx->members[start + i].val;
+    }
+    idx->members_len = start;
+cleanup:
+    (*depth)--;
+    if (err) {
+        // the members are allocated from the arena, so just drop them
+        idx->members_len = start;
+    }
+    return err;
+}
+
+void json_index_build_object(json_index* idx, hashmap* obj, size_t start) {
+    size_t count = idx->members_len - start;
+    size_t cap = hashmap_cap_for(count);
+    entry* data = json_arena_alloc(idx->arena, hashmap_data_size(cap));
+    memset(data, 0, hashmap_data_size(cap));
+    hashmap_init(obj, hashmap_strcmp, hashmap_strlen, HASH_FUNC_WYHASH, data, cap);
+    // arena objects are never freed, so their order lives in the arena as well
+    hashmap_init_order(obj, json_arena_alloc(idx->arena, count * sizeof(entry*)), count);
+    for (size_t i = start; i < idx->members_len; i++) {
+        json_value* val = json_arena_alloc(idx->arena, sizeof(json_value));
+        *val = idx->members[i].val;
+        // a repeated key replaces the value, which stays in the arena
+        hashmap_insert_hashed(obj, idx->members[i].key, val, idx->members[i].hash);
+    }
+    idx->members_len = start;
+}
+
+int json_index_object(json_index* idx, hashmap* obj, size_t* depth) {
+    unsigned char c;
+    size_t pos;
+    int err = 0;
+    char* key;
+    size_t start = idx->members_len;
+    (*depth)++;
+    if (*depth > JSON_MAX_DEPTH) {
+        idx->end = idx->tokens[idx->next - 1] + 1;
+        err = ERR_JSON_DEPTH_EXCEEDED;
+        goto cleanup;
+    }
+    if (idx->next < idx->tokens_len && idx->data[idx->tokens[idx->next]] == '}') {
+        idx->end = idx->tokens[idx->next] + 1;
+        idx->next++;
+        goto cleanup;
+    }
+    while (true) {
+        err = json_index_next(idx, &c, &pos);
+        if (err) {
+            goto cleanup;
+        }
+        if (c != '"') {
+            err = json_index_unexpected(idx, pos);
+            goto cleanup;
+        }
+        size_t hash = 0;
+        err = json_index_key(idx, pos, &key, &hash);
+        if (err) {
+            goto cleanup;
+        }
+        err = json_index_next(idx, &c, &pos);
+        if (err) {
+            goto cleanup;
+        }
+        if (c != ':') {
+            err = json_index_unexpected(idx, pos);
+            goto cleanup;
+        }
+        json_value val;
+        err = json_index_value(idx, &val, depth);
+        if (err) {
+            goto cleanup;
+        }
+        if (!idx->validate) {
+            json_index_push_member(idx, key, hash, &val);
+        }
+        err = json_index_next(idx, &c, &pos);
+        if (err) {
+            goto cleanup;
+        }
+        if (c == '}') {
+            idx->end = pos + 1;
+            break;
+        }
+        if (c != ',') {
+            err = json_index_unexpected(idx, pos);
+            goto cleanup;
+        }
+    }
+cleanup:
+    (*depth)--;
+    if (err) {
+        // the members are allocated from the arena, so just drop them
+        idx->members_len = start;
+        return err;
+    }
+    if (idx->validate) {
+        return 0;
+    }
+    json_index_build_object(idx, obj, start);
+    return 0;
+}
+
+// references the object or array of the last token in val
+// and skips its tokens
+void json_index_lazy(json_index* idx, json_value* val) {
+    json_lazy* lazy = json_arena_alloc(idx->arena, sizeof(json_lazy));
+    lazy->doc = idx;
+    lazy->token = idx->next - 1;
+    lazy->resolved = false;
+    val->ty = JSON_TY_LAZY;
+    val->inner.lazy = lazy;
+    // the input is already validated, so brackets are balanced
+    size_t depth = 1;
+    while (depth > 0) {
+        unsigned char c = idx->data[idx->tokens[idx->next]];
+        if (c == '{' || c == '[') {
+            depth++;
+        } else if (c == '}' || c == ']') {
+            depth--;
+        }
+        idx->next++;
+    }
+    idx->end = idx->tokens[idx->next - 1] + 1;
+}
+
+// stage two: builds val from the next tokens
+int json_index_value(json_index* idx, json_value* val, size_t* depth) {
+    unsigned char c;
+    size_t pos;
+    int err = json_index_next(idx, &c, &pos);
+    if (err) {
+        return err;
+    }
+    if ((c >= '0' && c <= '9') || c == '-') {
+        val->ty = JSON_TY_NUMBER;
+        return json_index_number(idx, pos, &val->inner.num);
+    }
+    switch (c) {
+        case '"':
+            val->ty = JSON_TY_STRING;
+            return json_index_str(idx, pos, &val->inner.str);
+        case 't':
+            val->ty = JSON_TY_TRUE;
+            return json_index_literal(idx, pos, "true", 4, *depth);
+        case 'f':
+            val->ty = JSON_TY_FALSE;
+            return json_index_literal(idx, pos, "false", 5, *depth);
+        case 'n':
+            val->ty = JSON_TY_NULL;
+            return json_index_literal(idx, pos, "null", 4, *depth);
+        case '[':
+            if (idx->lazy) {
+                json_index_lazy(idx, val);
+                return 0;
+            }
+            val->ty = JSON_TY_ARRAY;
+            return json_index_array(idx, &val->inner.arr, depth);
+        case '{':
+            if (idx->lazy) {
+                json_index_lazy(idx, val);
+                return 0;
+            }
+            val->ty = JSON_TY_OBJECT;
+            return json_index_object(idx, &val->inner.obj, depth);
+    }
+    return json_index_unexpected(idx, pos);
+}
+
+#define JSON_MEMBERS_DEFAULT_CAP 64
+
+// allocates the buffers needed while building values
+void json_index_scratch_new(json_index* idx) {
+    idx->members_len = 0;
+    idx->members_cap = JSON_MEMBERS_DEFAULT_CAP;
+    idx->members = malloc(idx->members_cap * sizeof(json_member));
+    assert(idx->members);
+    idx->str_cap = 32;
+    idx->str = malloc(idx->str_cap);
+    assert(idx->str);
+}
+
+void json_index_init(json_index* idx, stream* st, json_arena* arena) {
+    buffer* buf = &st->inner.data;
+    *idx = (json_index){
+        .data = buf->data + buf->pos,
+        .len = buf->len - buf->pos,
+        .tokens_len = 0,
+        .tokens_cap = JSON_INDEX_DEFAULT_CAP,
+        .next = 0,
+        .end = 0,
+        .arena = arena,
+        .insitu = NULL,
+        .validate = false,
+        .lazy = false,
+        .prev_doc = NULL,
+    };
+    if (arena->tokens != NULL) {
+        // reuse the buffers of the previous document
+        idx->tokens = arena->tokens;
+        idx->tokens_cap = arena->tokens_cap;
+        idx->members = arena->members;
+        idx->members_cap = arena->members_cap;
+        idx->members_len = 0;
+        idx->str = arena->str;
+        idx->str_cap = arena->str_cap;
+        arena->tokens = NULL;
+        arena->members = NULL;
+        arena->str = NULL;
+    } else {
+        idx->tokens = malloc(idx->tokens_cap * sizeof(uint32_t));
+        assert(idx->tokens);
+        json_index_scratch_new(idx);
+    }
+    hashmap_new(&idx->keys, hashmap_strcmp, hashmap_strlen, HASH_FUNC_WYHASH);
+}
+
+void json_index_free(json_index* idx) {
+    hashmap_free(&idx->keys);
+    // hand the buffers back for the next document
+    json_arena* arena = idx->arena;
+    free(arena->tokens);
+    free(arena->members);
+    free(arena->str);
+    arena->tokens = idx->tokens;
+    arena->tokens_cap = idx->tokens_cap;
+    arena->members = idx->members;
+    arena->members_cap = idx->members_cap;
+    arena->str = idx->str;
+    arena->str_cap = idx->str_cap;
+}
+
+// runs both stages on the input of st
+int json_index_parse(json_index* idx, stream* st, json_value* val) {
+    json_index_build(idx);
+    size_t depth = 0;
+    int err = json_index_value(idx, val, &depth);
+    // on error end is where the streaming parser would have failed
+    st->inner.data.pos += idx->end;
+    return err;
+}
+
+int json_parse_indexed(stream* st, json_value* val, json_arena* arena, bool insitu) {
+    json_index idx;
+    json_index_init(&idx, st, arena);
+    if (insitu) {
+        idx.insitu = (char*)idx.data;
+    }
+    int err = json_index_parse(&idx, st, val);
+    json_index_free(&idx);
+    return err;
+}
+
+bool json_indexable(const stream* st) {
+    if (st->ty != STREAM_MEMORY && st->ty != STREAM_MMAP) {
+        return false;
+    }
+    return st->inner.data.len - st->inner.data.pos <= JSON_INDEX_MAX_LEN;
+}
+
 int json_parse(stream* st, json_value* val) {
     char last_char;
     size_t depth = 0;
@@ -613,6 +1507,97 @@ int json_parse(stream* st, json_value* val) {
     return 0;
 }
 
+int json_parse_arena(stream* st, json_value* val, json_arena* arena) {
+    if (!json_indexable(st)) {
+        return ERR_JSON_UNSUPPORTED_STREAM;
+    }
+    return json_parse_indexed(st, val, arena, false);
+}
+
+int json_parse_lazy(stream* st, json_value* val, json_arena* arena) {
+    if (!json_indexable(st)) {
+        return ERR_JSON_UNSUPPORTED_STREAM;
+    }
+    json_index idx;
+    json_index_init(&idx, st, arena);
+    idx.validate = true;
+    int err = json_index_parse(&idx, st, val);
+    if (err) {
+        json_index_free(&idx);
+        return err;
+    }
+    // the document takes over the buffers of the index for json_resolve
+    // until it is released with the arena, lazy keys are never interned
+    hashmap_free(&idx.keys);
+    // a valid document has at least one token
+    idx.tokens_cap = idx.tokens_len;
+    idx.tokens = realloc(idx.tokens, idx.tokens_cap * sizeof(uint32_t));
+    assert(idx.tokens);
+    json_index* doc = json_arena_alloc(arena, sizeof(json_index));
+    *doc = idx;
+    doc->validate = false;
+    doc->lazy = true;
+    doc->next = 0;
+    doc->prev_doc = arena->docs;
+    arena->docs = doc;
+    size_t depth = 0;
+    return json_index_value(doc, val, &depth);
+}
+
+void json_arena_release_docs(json_arena* arena) {
+    while (arena->docs != NULL) {
+        json_index* doc = arena->docs;
+        arena->docs = doc->prev_doc;
+        if (arena->tokens != NULL) {
+            free(doc->tokens);
+            free(doc->members);
+            free(doc->str);
+            continue;
+        }
+        // hand the buffers back for the next document
+        arena->tokens = doc->tokens;
+        arena->tokens_cap = doc->tokens_cap;
+        arena->members = doc->members;
+        arena->members_cap = doc->members_cap;
+        arena->str = doc->str;
+        arena->str_cap = doc->str_cap;
+    }
+}
+
+void json_resolve(json_value* val) {
+    if (val->ty != JSON_TY_LAZY) {
+        return;
+    }
+    json_lazy* lazy = val->inner.lazy;
+    if (!lazy->resolved) {
+        json_index* doc = lazy->doc;
+        doc->next = lazy->token + 1;
+        size_t depth = 0;
+        int err;
+        if (doc->data[doc->tokens[lazy->token]] == '[') {
+            lazy->val.ty = JSON_TY_ARRAY;
+            err = json_index_array(doc, &lazy->val.inner.arr, &depth);
+        } else {
+            lazy->val.ty = JSON_TY_OBJECT;
+            err = json_index_object(doc, &lazy->val.inner.obj, &depth);
+        }
+        // the span was validated by json_parse_lazy with the same code, so
+        // this only fails if the data changed, never cache a partial value
+        if (err) {
+            lazy->val = JSON_NULL;
+        }
+        lazy->resolved = true;
+    }
+    *val = lazy->val;
+}
+
+int json_parse_insitu(stream* st, json_value* val, json_arena* arena) {
+    if (st->ty != STREAM_MEMORY || !json_indexable(st)) {
+        return ERR_JSON_UNSUPPORTED_STREAM;
+    }
+    return json_parse_indexed(st, val, arena, true);
+}
+
 char* json_describe_err(int err) {
     switch (err) {
         case ERR_JSON_INVALID_SYNTAX:
@@ -623,6 +1608,8 @@ char* json_describe_err(int err) {
             return "exceeded maximum nesting depth";
         case ERR_JSON_BUFFER_OVERFLOW:
             return "overflowed buffer";
+        case ERR_JSON_UNSUPPORTED_STREAM:
+            return "unsupported stream type";
         case ERR_INVALID_UTF8:
             return "invalid utf8 sequence";
         case EOF:
@@ -6,19 +6,97 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define HASHMAP_DEFAULT_CAP 24
+#define HASHMAP_DEFAULT_CAP 4
+// Maps with at most this many entries keep them packed at the
+// start of data and are searched linearly without hashing.
+#define HASHMAP_SMALL_CAP 8
+// capacity of a map leaving the small representation
+#define HASHMAP_HASHED_CAP 16
+
+// Larger maps follow a control byte per entry after the entries.
+// It is 0 for free entries and otherwise holds the high bit and 7 bits
+// of the hash of the key. Eight control bytes are probed at once, so
+// the key is only compared on matching bytes. The first group is
+// repeated after the last to load groups at the end without wrapping.
+#define HASHMAP_GROUP 8
+#define HASHMAP_CTRL_FULL 0x80
+
+#define GROUP_ONES 0x0101010101010101ULL
+#define GROUP_HIGHS 0x8080808080808080ULL
 
 void hashmap_new(hashmap* map, hashmap_cmp cmp, hashmap_key_len key_len, hash_func hash) {
-    map->len = HASHMAP_DEFAULT_CAP;
-    map->data = calloc(map->len, sizeof(entry));
-    assert(map->data);
+    entry* data = calloc(HASHMAP_DEFAULT_CAP, sizeof(entry));
+    assert(data);
+    hashmap_init(map, cmp, key_len, hash, data, HASHMAP_DEFAULT_CAP);
+}
+
+void hashmap_init(hashmap* map, hashmap_cmp cmp, hashmap_key_len key_len, hash_func hash, entry* data, size_t len) {
+    map->len = len;
+    map->data = data;
     map->count = 0;
     map->cmp = cmp;
     map->hash = hash;
     map->key_len = key_len;
 }
 
+bool hashmap_is_small(const hashmap* map) {
+    return map->len <= HASHMAP_SMALL_CAP;
+}
+
+size_t hashmap_cap_for(size_t count) {
+    if (count <= HASHMAP_SMALL_CAP) {
+        return count;
+    }
+    // keeps the load below the growth threshold in hashmap_insert
+    size_t cap = HASHMAP_HASHED_CAP;
+    while (count > cap / 8 * 7) {
+        cap *= 2;
+    }
+    return cap;
+}
+
+// Larger maps keep the order built by hashmap_order after their
+// control bytes, so it is shared by all copies of the map.
+typedef struct {
+    entry** entries;
+    size_t cap;
+    bool valid;
+    // false for storage passed to hashmap_init_order
+    bool owned;
+} hashmap_order_st;
+
+size_t hashmap_data_size(size_t len) {
+    if (len <= HASHMAP_SMALL_CAP) {
+        return len * sizeof(entry);
+    }
+    // len is a power of two, so the order stays aligned
+    return len * sizeof(entry) + len + HASHMAP_GROUP + sizeof(hashmap_order_st);
+}
+
+uint8_t* hashmap_ctrl(const hashmap* map) {
+    return (uint8_t*)(map->data + map->len);
+}
+
+hashmap_order_st* hashmap_order_of(const hashmap* map) {
+    return (hashmap_order_st*)(hashmap_ctrl(map) + map->len + HASHMAP_GROUP);
+}
+
+void hashmap_order_free(hashmap* map) {
+    if (!hashmap_is_small(map) && hashmap_order_of(map)->owned) {
+        free(hashmap_order_of(map)->entries);
+    }
+}
+
+void hashmap_clear(hashmap* map) {
+    hashmap_order_free(map);
+    memset(map->data, 0, hashmap_data_size(map->len));
+    map->count = 0;
+}
+
 void hashmap_free(hashmap* map) {
+    if (map->data != NULL) {
+        hashmap_order_free(map);
+    }
     free(map->data);
     map->len = 0;
     map->count = 0;
@@ -33,71 +111,362 @@ uint64_t djb2(const void* data, size_t len) {
     return hash;
 }
 
+// wyhash (final version 4) by Wang Yi, released into the public domain
+uint64_t wyhash_seed = 0;
+
+void hashmap_seed(uint64_t seed) {
+    wyhash_seed = seed;
+}
+
+void wyhash_mum(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32);
+    uint64_t c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+uint64_t wyhash_mix(uint64_t a, uint64_t b) {
+    wyhash_mum(&a, &b);
+    return a ^ b;
+}
+
+uint64_t wyhash_read8(const uint8_t* p) {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+           (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+uint64_t wyhash_read4(const uint8_t* p) {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24;
+}
+
+#define WYHASH_P0 0x2d358dccaa6c78a5ULL
+#define WYHASH_P1 0x8bb84b93962eacc9ULL
+#define WYHASH_P2 0x4b33a62ed433d4a3ULL
+#define WYHASH_P3 0x4d5a2da51de1aa47ULL
+
+uint64_t wyhash(const void* data, size_t len, uint64_t seed) {
+    const uint8_t* p = (const uint8_t*)data;
+    seed ^= wyhash_mix(seed ^ WYHASH_P0, WYHASH_P1);
+    uint64_t a;
+    uint64_t b;
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wyhash_read4(p) << 32) | wyhash_read4(p + ((len >> 3) << 2));
+            b = (wyhash_read4(p + len - 4) << 32) | wyhash_read4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = 0;
+            b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed;
+            uint64_t see2 = seed;
+            do {
+                seed = wyhash_mix(wyhash_read8(p) ^ WYHASH_P1, wyhash_read8(p + 8) ^ seed);
+                see1 = wyhash_mix(wyhash_read8(p + 16) ^ WYHASH_P2, wyhash_read8(p + 24) ^ see1);
+                see2 = wyhash_mix(wyhash_read8(p + 32) ^ WYHASH_P3, wyhash_read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wyhash_mix(wyhash_read8(p) ^ WYHASH_P1, wyhash_read8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wyhash_read8(p + i - 16);
+        b = wyhash_read8(p + i - 8);
+    }
+    a ^= WYHASH_P1;
+    b ^= seed;
+    wyhash_mum(&a, &b);
+    return wyhash_mix(a ^ WYHASH_P0 ^ len, b ^ WYHASH_P1);
+}
+
 size_t hashmap_hash(const hashmap* map, const void* key) {
     switch (map->hash) {
         case HASH_FUNC_IDENTITY:
             return (size_t)key;
         case HASH_FUNC_DJB2:
             return djb2(key, map->key_len(key));
+        case HASH_FUNC_WYHASH:
+            return wyhash(key, map->key_len(key), wyhash_seed);
     }
     assert(0);
     return 0;
 }
 
-entry hashmap_insert(hashmap* map, void* key, void* value) {
-    if (map->count * 10 / map->len > 7) {
-        size_t old_len = map->len;
-        entry* old_data = map->data;
-        map->len = map->len * 3 / 2;
-        map->data = calloc(map->len, sizeof(entry));
-        map->count = 0;
-        assert(map->data);
-        for (entry* entry = old_data; entry < old_data + old_len; entry++) {
-            if (entry->exists) {
-                hashmap_insert(map, entry->key, entry->value);
+// Spreads hash over 32 bits, which are kept in the entry, so growing
+// does not rehash keys. The low bits select the group, the high bits
+// form the control byte.
+uint32_t hashmap_mix(size_t hash) {
+    uint64_t x = (uint64_t)hash * 0x9e3779b97f4a7c15ULL;
+    return (uint32_t)(x >> 32) ^ (uint32_t)x;
+}
+
+uint8_t hashmap_ctrl_byte(uint32_t mixed) {
+    return HASHMAP_CTRL_FULL | (mixed >> 25);
+}
+
+// loads little-endian, which compilers reduce to a single load on most targets
+uint64_t hashmap_load_group(const uint8_t* ctrl) {
+    return (uint64_t)ctrl[0] | (uint64_t)ctrl[1] << 8 | (uint64_t)ctrl[2] << 16 | (uint64_t)ctrl[3] << 24 |
+           (uint64_t)ctrl[4] << 32 | (uint64_t)ctrl[5] << 40 | (uint64_t)ctrl[6] << 48 | (uint64_t)ctrl[7] << 56;
+}
+
+// Returns the high bits of the bytes of group equal to byte. May report
+// bytes above a matching byte as well, so candidates are compared anyway.
+uint64_t hashmap_group_match(uint64_t group, uint8_t byte) {
+    uint64_t x = group ^ (GROUP_ONES * byte);
+    return (x - GROUP_ONES) & ~x & GROUP_HIGHS;
+}
+
+uint64_t hashmap_group_free(uint64_t group) {
+    return ~group & GROUP_HIGHS;
+}
+
+// index of the byte of the lowest high bit set in mask
+size_t hashmap_group_lowest(uint64_t mask) {
+    uint64_t lowest = (mask & (~mask + 1)) >> 7;
+    return (size_t)((lowest * 0x0001020304050607ULL) >> 56);
+}
+
+void hashmap_set_ctrl(hashmap* map, size_t idx, uint8_t byte) {
+    uint8_t* ctrl = hashmap_ctrl(map);
+    ctrl[idx] = byte;
+    if (idx < HASHMAP_GROUP) {
+        ctrl[map->len + idx] = byte;
+    }
+}
+
+// Returns the entry holding key or the free entry to insert it into.
+entry* hashmap_find(const hashmap* map, const void* key, uint32_t mixed) {
+    const uint8_t* ctrl = hashmap_ctrl(map);
+    uint8_t byte = hashmap_ctrl_byte(mixed);
+    size_t mask = map->len - 1;
+    size_t pos = mixed & mask;
+    while (true) {
+        uint64_t group = hashmap_load_group(ctrl + pos);
+        for (uint64_t match = hashmap_group_match(group, byte); match != 0; match &= match - 1) {
+            entry* current = map->data + ((pos + hashmap_group_lowest(match)) & mask);
+            if (current->exists && current->hash == mixed && map->cmp(key, current->key) == 0) {
+                return current;
             }
         }
-        free(old_data);
+        uint64_t free_mask = hashmap_group_free(group);
+        if (free_mask != 0) {
+            return map->data + ((pos + hashmap_group_lowest(free_mask)) & mask);
+        }
+        // the load limit guarantees a free entry
+        pos = (pos + HASHMAP_GROUP) & mask;
+    }
+}
+
+void hashmap_init_order(hashmap* map, entry** storage, size_t cap) {
+    if (hashmap_is_small(map)) {
+        return;
+    }
+    hashmap_order_free(map);
+    hashmap_order_st* order = hashmap_order_of(map);
+    *order = (hashmap_order_st){.entries = storage, .cap = cap, .valid = false, .owned = false};
+}
+
+// heap sort, as qsort cannot pass map->cmp to the comparison
+void hashmap_sift_down(const hashmap* map, entry** entries, size_t root, size_t len) {
+    while (2 * root + 1 < len) {
+        size_t child = 2 * root + 1;
+        if (child + 1 < len && map->cmp(entries[child]->key, entries[child + 1]->key) < 0) {
+            child++;
+        }
+        if (map->cmp(entries[root]->key, entries[child]->key) >= 0) {
+            return;
+        }
+        entry* tmp = entries[root];
+        entries[root] = entries[child];
+        entries[child] = tmp;
+        root = child;
+    }
+}
+
+void hashmap_order(hashmap* map) {
+    if (hashmap_is_small(map)) {
+        // packed entries are searched linearly, so they can be reordered,
+        // which is cheap once sorted
+        for (size_t i = 1; i < map->count; i++) {
+            entry current = map->data[i];
+            size_t j = i;
+            while (j > 0 && map->cmp(map->data[j - 1].key, current.key) > 0) {
+                map->data[j] = map->data[j - 1];
+                j--;
+            }
+            map->data[j] = current;
+        }
+        return;
+    }
+    hashmap_order_st* order = hashmap_order_of(map);
+    if (order->valid) {
+        return;
+    }
+    if (order->cap < map->count) {
+        if (order->owned) {
+            free(order->entries);
+        }
+        order->cap = map->count;
+        order->entries = malloc(order->cap * sizeof(entry*));
+        assert(order->entries);
+        order->owned = true;
+    }
+    size_t n = 0;
+    for (entry* current = map->data; current < map->data + map->len; current++) {
+        if (current->exists) {
+            order->entries[n] = current;
+            n++;
+        }
+    }
+    for (size_t i = n / 2; i > 0; i--) {
+        hashmap_sift_down(map, order->entries, i - 1, n);
+    }
+    for (size_t i = n; i > 1; i--) {
+        entry* tmp = order->entries[0];
+        order->entries[0] = order->entries[i - 1];
+        order->entries[i - 1] = tmp;
+        hashmap_sift_down(map, order->entries, 0, i - 1);
+    }
+    order->valid = true;
+}
+
+entry* hashmap_ordered(const hashmap* map, size_t idx) {
+    if (hashmap_is_small(map)) {
+        return map->data + idx;
+    }
+    return hashmap_order_of(map)->entries[idx];
+}
+
+// Inserts key, which is known to be missing from map.
+void hashmap_put_new(hashmap* map, void* key, void* value, uint32_t mixed) {
+    const uint8_t* ctrl = hashmap_ctrl(map);
+    size_t mask = map->len - 1;
+    size_t pos = mixed & mask;
+    uint64_t free_mask;
+    while ((free_mask = hashmap_group_free(hashmap_load_group(ctrl + pos))) == 0) {
+        pos = (pos + HASHMAP_GROUP) & mask;
     }
+    entry* free_entry = map->data + ((pos + hashmap_group_lowest(free_mask)) & mask);
+    *free_entry = (entry){.exists = true, .hash = mixed, .key = key, .value = value};
+    hashmap_set_ctrl(map, free_entry - map->data, hashmap_ctrl_byte(mixed));
+    map->count++;
+}
 
-    uint64_t hash = hashmap_hash(map, key);
-    size_t start = hash % map->len;
-    for (size_t counter = 0; counter < map->len; counter++) {
-        size_t idx = (start + counter) % map->len;
-        entry* current = map->data + idx;
+void hashmap_grow(hashmap* map, size_t len) {
+    size_t old_len = map->len;
+    bool was_small = hashmap_is_small(map);
+    entry* old_data = map->data;
+    map->len = len;
+    map->data = calloc(1, hashmap_data_size(len));
+    map->count = 0;
+    assert(map->data);
+    for (entry* current = old_data; current < old_data + old_len; current++) {
         if (!current->exists) {
-            current->exists = true;
-            current->key = key;
-            current->value = value;
+            continue;
+        }
+        if (hashmap_is_small(map)) {
+            map->data[map->count] = *current;
             map->count++;
-            return (entry){.exists = false};
+        } else {
+            // hashes are kept once a map is hashed
+            uint32_t mixed = was_small ? hashmap_mix(hashmap_hash(map, current->key)) : current->hash;
+            hashmap_put_new(map, current->key, current->value, mixed);
         }
-        if (map->cmp(key, current->key) == 0) {
-            entry prev = *current;
-            current->value = value;
-            current->key = key;
-            return prev;
+    }
+    if (old_len > HASHMAP_SMALL_CAP) {
+        // the order referenced the old entries
+        hashmap_order_st* order = (hashmap_order_st*)((uint8_t*)(old_data + old_len) + old_len + HASHMAP_GROUP);
+        if (order->owned) {
+            free(order->entries);
         }
     }
-    assert(0);
-    return (entry){};
+    free(old_data);
 }
 
-int hashmap_get(const hashmap* map, const void* key, const void** out) {
-    uint64_t hash = hashmap_hash(map, key);
-    size_t start = hash % map->len;
-    for (size_t counter = 0; counter < map->len; counter++) {
-        size_t idx = (start + counter) % map->len;
-        entry* current = map->data + idx;
-        if(!current->exists) {
-            return 0;
+entry hashmap_insert(hashmap* map, void* key, void* value) {
+    // small maps do not hash
+    return hashmap_insert_hashed(map, key, value, hashmap_is_small(map) ? 0 : hashmap_hash(map, key));
+}
+
+entry hashmap_insert_hashed(hashmap* map, void* key, void* value, size_t hash) {
+    if (hashmap_is_small(map)) {
+        for (entry* current = map->data; current < map->data + map->count; current++) {
+            if (map->cmp(key, current->key) == 0) {
+                entry prev = *current;
+                current->value = value;
+                current->key = key;
+                return prev;
+            }
         }
-        if (map->cmp(key, current->key) == 0) {
-            *out = current->value;
-            return 1;
+        if (map->count < map->len) {
+            map->data[map->count] = (entry){.exists = true, .key = key, .value = value};
+            map->count++;
+            return (entry){.exists = false};
         }
+        size_t len = map->len < 2 ? 2 : map->len * 3 / 2;
+        hashmap_grow(map, len > HASHMAP_SMALL_CAP ? HASHMAP_HASHED_CAP : len);
+        return hashmap_insert(map, key, value);
     }
-    return 0;
+    uint32_t mixed = hashmap_mix(hash);
+    entry* current = hashmap_find(map, key, mixed);
+    if (current->exists) {
+        entry prev = *current;
+        current->value = value;
+        current->key = key;
+        return prev;
+    }
+    if (map->count + 1 > map->len / 8 * 7) {
+        hashmap_grow(map, map->len * 2);
+        hashmap_put_new(map, key, value, mixed);
+        return (entry){.exists = false};
+    }
+    *current = (entry){.exists = true, .hash = mixed, .key = key, .value = value};
+    hashmap_set_ctrl(map, current - map->data, hashmap_ctrl_byte(mixed));
+    map->count++;
+    hashmap_order_of(map)->valid = false;
+    return (entry){.exists = false};
+}
+
+int hashmap_get(const hashmap* map, const void* key, const void** out) {
+    return hashmap_get_hashed(map, key, hashmap_is_small(map) ? 0 : hashmap_hash(map, key), out);
+}
+
+int hashmap_get_hashed(const hashmap* map, const void* key, size_t hash, const void** out) {
+    if (hashmap_is_small(map)) {
+        for (const entry* current = map->data; current < map->data + map->count; current++) {
+            if (map->cmp(key, current->key) == 0) {
+                *out = current->value;
+                return 1;
+            }
+        }
+        return 0;
+    }
+    const entry* current = hashmap_find(map, key, hashmap_mix(hash));
+    if (!current->exists) {
+        return 0;
+    }
+    *out = current->value;
+    return 1;
 }
 
 void hashmap_iter(const hashmap* map, void* userdata, void (*f)(entry*, void*)) {
@@ -123,6 +492,10 @@ void** hashmap_keys(const hashmap* map) {
 }
 
 int hashmap_strcmp(const void* a, const void* b) {
+    // interned keys are equal by address
+    if (a == b) {
+        return 0;
+    }
     return strcmp(a, b);
 }
 
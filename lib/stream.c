@@ -3,6 +3,19 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// memory-mapped files are only available on POSIX systems
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#include <unistd.h>
+#endif
+#if defined(_POSIX_MAPPED_FILES) && _POSIX_MAPPED_FILES > 0
+#define STREAM_HAS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 void stream_open_memory(stream* stream, const void* data, size_t len) {
     stream->ty = STREAM_MEMORY;
@@ -21,6 +34,89 @@ int stream_open_file(stream* stream, const char* filename) {
     return 0;
 }
 
+#ifdef STREAM_HAS_MMAP
+int stream_open_mmap(stream* stream, const char* filename) {
+    stream->ty = STREAM_MMAP;
+    stream->inner.data = (buffer){.data = NULL, .len = 0, .pos = 0};
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        int result = errno;
+        errno = 0;
+        return result;
+    }
+    struct stat st;
+    int result = 0;
+    if (fstat(fd, &st) == -1) {
+        result = errno;
+        errno = 0;
+        goto cleanup;
+    }
+    // e.g. pipes cannot be mapped, but report a size of 0
+    if (!S_ISREG(st.st_mode)) {
+        result = ENODEV;
+        goto cleanup;
+    }
+    // mapping zero bytes is invalid
+    if (st.st_size == 0) {
+        goto cleanup;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        result = errno;
+        errno = 0;
+        goto cleanup;
+    }
+    stream->inner.data.data = data;
+    stream->inner.data.len = st.st_size;
+cleanup:
+    close(fd);
+    return result;
+}
+#else
+int stream_open_mmap(stream* stream, const char* filename) {
+    stream->ty = STREAM_MMAP;
+    stream->inner.data = (buffer){.data = NULL, .len = 0, .pos = 0};
+    return ERR_MMAP_UNSUPPORTED;
+}
+#endif
+
+void stream_open_buffered(stream* stream, FILE* file) {
+    stream->ty = STREAM_BUFFERED;
+    stream->inner.refill = (refill_buffer){.file = file, .len = 0, .pos = 0, .offset = 0};
+    stream->inner.refill.data = malloc(STREAM_BUFFER_CAP);
+    assert(stream->inner.refill.data);
+}
+
+// tells a read error on file apart from its end, after a read
+// returned no data. Returns EOF at the end of file.
+int stream_file_err(FILE* file) {
+    if (!ferror(file)) {
+        return EOF;
+    }
+    int result = errno;
+    errno = 0;
+    // the C standard does not require reads to set errno
+    return result != 0 ? result : ERR_STREAM_READ;
+}
+
+// reads the next bytes from the file, but keeps the last
+// STREAM_LOOKBACK bytes available to seek back into.
+int stream_refill(refill_buffer* buf) {
+    if (buf->len == STREAM_BUFFER_CAP) {
+        size_t discard = STREAM_BUFFER_CAP - STREAM_LOOKBACK;
+        memmove(buf->data, buf->data + discard, STREAM_LOOKBACK);
+        buf->len -= discard;
+        buf->pos -= discard;
+        buf->offset += discard;
+    }
+    size_t n = fread(buf->data + buf->len, 1, STREAM_BUFFER_CAP - buf->len, buf->file);
+    if (n == 0) {
+        return stream_file_err(buf->file);
+    }
+    buf->len += n;
+    return 0;
+}
+
 int stream_close(stream* stream) {
     if (stream->ty == 0 || stream->ty == STREAM_MEMORY) {
         return 0;
@@ -28,6 +124,24 @@ int stream_close(stream* stream) {
     if (stream->ty == STREAM_FILE) {
         return fclose(stream->inner.file);
     }
+    if (stream->ty == STREAM_BUFFERED) {
+        free(stream->inner.refill.data);
+        stream->inner.refill.data = NULL;
+        return 0;
+    }
+    if (stream->ty == STREAM_MMAP) {
+        if (stream->inner.data.len == 0) {
+            return 0;
+        }
+#ifdef STREAM_HAS_MMAP
+        if (munmap((void*)stream->inner.data.data, stream->inner.data.len) == -1) {
+            int result = errno;
+            errno = 0;
+            return result;
+        }
+#endif
+        return 0;
+    }
     assert(0);
     return 0;
 }
@@ -35,8 +149,12 @@ int stream_close(stream* stream) {
 int stream_pos(stream* stream, long* pos) {
     switch (stream->ty) {
         case STREAM_MEMORY:
+        case STREAM_MMAP:
             *pos = stream->inner.data.pos;
             return 0;
+        case STREAM_BUFFERED:
+            *pos = stream->inner.refill.offset + stream->inner.refill.pos;
+            return 0;
         case STREAM_FILE:
             *pos = ftell(stream->inner.file);
             if (*pos == -1) {
@@ -51,14 +169,23 @@ int stream_pos(stream* stream, long* pos) {
 }
 
 int stream_set_pos(stream* stream, long pos) {
+    refill_buffer* refill = NULL;
     int result = 0;
     switch (stream->ty) {
         case STREAM_MEMORY:
+        case STREAM_MMAP:
             if (pos > stream->inner.data.len) {
                 return EINVAL;
             }
             stream->inner.data.pos = pos;
             return 0;
+        case STREAM_BUFFERED:
+            refill = &stream->inner.refill;
+            if (pos < refill->offset || pos > refill->offset + (long)refill->len) {
+                return EINVAL;
+            }
+            refill->pos = pos - refill->offset;
+            return 0;
         case STREAM_FILE:
             result = fseek(stream->inner.file, pos, SEEK_SET);
             if (result == -1) {
@@ -74,9 +201,11 @@ int stream_set_pos(stream* stream, long pos) {
 
 int stream_read(stream* stream, unsigned char* out) {
     buffer* buf = NULL;
+    refill_buffer* refill = NULL;
     int result = 0;
     switch (stream->ty) {
         case STREAM_MEMORY:
+        case STREAM_MMAP:
             buf = &stream->inner.data;
             if (buf->pos >= buf->len) {
                 return EOF;
@@ -84,10 +213,21 @@ int stream_read(stream* stream, unsigned char* out) {
             *out = buf->data[buf->pos];
             buf->pos++;
             return 0;
+        case STREAM_BUFFERED:
+            refill = &stream->inner.refill;
+            if (refill->pos >= refill->len) {
+                result = stream_refill(refill);
+                if (result) {
+                    return result;
+                }
+            }
+            *out = refill->data[refill->pos];
+            refill->pos++;
+            return 0;
         case STREAM_FILE:
             result = fgetc(stream->inner.file);
             if (result == EOF) {
-                return EOF;
+                return stream_file_err(stream->inner.file);
             }
             *out = (unsigned char)result;
             return 0;
@@ -98,16 +238,27 @@ int stream_read(stream* stream, unsigned char* out) {
 
 int stream_seek(stream* stream, size_t relative) {
     buffer* buf = NULL;
+    refill_buffer* refill = NULL;
+    size_t next = 0;
     int result = 0;
     switch (stream->ty) {
         case STREAM_MEMORY:
+        case STREAM_MMAP:
             buf = &stream->inner.data;
-            size_t next = buf->pos + relative;
+            next = buf->pos + relative;
             if (next < 0 || next > buf->len) {
                 return -1;
             }
             buf->pos = next;
             return 0;
+        case STREAM_BUFFERED:
+            refill = &stream->inner.refill;
+            next = refill->pos + relative;
+            if (next > refill->len) {
+                return -1;
+            }
+            refill->pos = next;
+            return 0;
         case STREAM_FILE:
             result = fseek(stream->inner.file, relative, SEEK_CUR);
             if (result == -1) {
@@ -121,6 +272,63 @@ int stream_seek(stream* stream, size_t relative) {
     return 0;
 }
 
+int stream_peek(stream* stream, const unsigned char** data, size_t* len) {
+    buffer* buf = NULL;
+    refill_buffer* refill = NULL;
+    int result = 0;
+    switch (stream->ty) {
+        case STREAM_MEMORY:
+        case STREAM_MMAP:
+            buf = &stream->inner.data;
+            if (buf->pos >= buf->len) {
+                return EOF;
+            }
+            *data = buf->data + buf->pos;
+            *len = buf->len - buf->pos;
+            return 0;
+        case STREAM_BUFFERED:
+            refill = &stream->inner.refill;
+            if (refill->pos >= refill->len) {
+                result = stream_refill(refill);
+                if (result) {
+                    return result;
+                }
+            }
+            *data = refill->data + refill->pos;
+            *len = refill->len - refill->pos;
+            return 0;
+        case STREAM_FILE:
+            result = fgetc(stream->inner.file);
+            if (result == EOF) {
+                return stream_file_err(stream->inner.file);
+            }
+            ungetc(result, stream->inner.file);
+            *data = (const unsigned char*)"";
+            *len = 0;
+            return 0;
+    }
+    assert(0);
+    return 0;
+}
+
+void stream_advance(stream* stream, size_t n) {
+    switch (stream->ty) {
+        case STREAM_MEMORY:
+        case STREAM_MMAP:
+            assert(stream->inner.data.pos + n <= stream->inner.data.len);
+            stream->inner.data.pos += n;
+            return;
+        case STREAM_BUFFERED:
+            assert(stream->inner.refill.pos + n <= stream->inner.refill.len);
+            stream->inner.refill.pos += n;
+            return;
+        case STREAM_FILE:
+            assert(n == 0);
+            return;
+    }
+    assert(0);
+}
+
 int stream_read_utf8_continuation(stream* st, unsigned char* out, size_t n) {
     unsigned char current;
     int err;
@@ -15,112 +15,81 @@
 #include "map.h"
 #include "stream.h"
 
-#define STACK_REFS_CAP 4
-
-typedef struct {
-    hashmap data;
-    size_t refs_len;
-    char* refs[STACK_REFS_CAP];
-} stack_frame;
+// Variables are resolved to slots at compile time. Slot indices are
+// relative to base, which is moved for every template call. Scopes are
+// left by popping the stack back to the length at their entry.
+typedef struct template_slot_st {
+    json_value val;
+    // set if val is freed once the slot is popped or reassigned
+    bool owned;
+} stack_slot;
 
 typedef struct {
+    size_t base;
     size_t len;
     size_t cap;
-    stack_frame* frames;
+    stack_slot* slots;
 } stack;
 
 #define DEFAULT_STACK_CAP 8
 
-void stack_new(stack* s) {
+void stack_new(stack* s, size_t cap) {
+    s->base = 0;
     s->len = 0;
-    s->cap = DEFAULT_STACK_CAP;
-    s->frames = malloc(sizeof(stack_frame) * s->cap);
-    assert(s->frames);
+    s->cap = cap < DEFAULT_STACK_CAP ? DEFAULT_STACK_CAP : cap;
+    s->slots = malloc(sizeof(stack_slot) * s->cap);
+    assert(s->slots);
 }
 
-void stack_free_entry(entry* entry, void* userdata) {
-    stack_frame* frame = (stack_frame*)userdata;
-    for (size_t i = 0; i < frame->refs_len; i++) {
-        if (strcmp(entry->key, frame->refs[i]) == 0) {
-            return;
+// frees all slots from len onwards
+void stack_pop(stack* s, size_t len) {
+    while (s->len > len) {
+        s->len--;
+        if (s->slots[s->len].owned) {
+            json_value_free(&s->slots[s->len].val);
         }
     }
-    free(entry->key);
-    json_value_free(entry->value);
-    free(entry->value);
-}
-
-void stack_push_frame(stack* s) {
-    if (s->len == s->cap) {
-        s->cap = s->cap * 3 / 2;
-        s->frames = realloc(s->frames, sizeof(stack_frame) * s->cap);
-        assert(s->frames);
-    }
-    hashmap_new(&s->frames[s->len].data, hashmap_strcmp, hashmap_strlen, HASH_FUNC_DJB2);
-    s->frames[s->len].refs_len = 0;
-    s->len++;
-}
-
-void stack_pop_frame(stack* s) {
-    assert(s->len > 0);
-    hashmap_iter(&s->frames[s->len - 1].data, &s->frames[s->len - 1], stack_free_entry);
-    hashmap_free(&s->frames[s->len - 1].data);
-    s->len--;
 }
 
 void stack_free(stack* s) {
-    while (s->len > 0) {
-        stack_pop_frame(s);
-    }
-    free(s->frames);
+    stack_pop(s, 0);
+    free(s->slots);
 }
 
-void stack_set_var(stack* s, char* var, json_value* value) {
-    stack_frame* current = &s->frames[s->len - 1];
-    entry previous = hashmap_insert(&current->data, (void*)var, value);
-    if (previous.exists) {
-        stack_free_entry(&previous, current);
-    }
-    for (size_t i = 0; i < current->refs_len; i++) {
-        if (strcmp(var, current->refs[i]) == 0) {
-            for (size_t j = i + 1; j < current->refs_len; j++) {
-                current->refs[j - 1] = current->refs[j];
+// stores val in the slot relative to base, which takes ownership
+// of val if owned is set. The previous value is freed if owned.
+void stack_set(stack* s, size_t slot, json_value val, bool owned) {
+    size_t idx = s->base + slot;
+    if (idx < s->len) {
+        if (s->slots[idx].owned) {
+            json_value_free(&s->slots[idx].val);
+        }
+    } else {
+        if (idx >= s->cap) {
+            while (idx >= s->cap) {
+                s->cap = s->cap * 3 / 2;
             }
-            current->refs_len--;
-            return;
+            s->slots = realloc(s->slots, sizeof(stack_slot) * s->cap);
+            assert(s->slots);
         }
-    }
-}
-
-int stack_set_ref(stack* s, char* var, json_value* value) {
-    stack_frame* current = &s->frames[s->len - 1];
-    if (current->refs_len == STACK_REFS_CAP) {
-        return ERR_BUF_OVERFLOW;
-    }
-    for (size_t i = 0; i < current->refs_len; i++) {
-        if (strcmp(var, current->refs[i]) == 0) {
-            // no match is possible, if the key is not already a ref
-            hashmap_insert(&current->data, (void*)var, value);
-            return 0;
+        // slots skipped by a short-circuited declaration stay nil
+        for (; s->len < idx; s->len++) {
+            s->slots[s->len].val.ty = JSON_TY_NULL;
+            s->slots[s->len].owned = false;
         }
+        s->len++;
     }
-    entry previous = hashmap_insert(&current->data, (void*)var, value);
-    if (previous.exists) {
-        stack_free_entry(&previous, current);
-    }
-    current->refs[current->refs_len] = var;
-    current->refs_len++;
-    return 0;
+    s->slots[idx].val = val;
+    s->slots[idx].owned = owned;
 }
 
-const json_value* stack_find_var(stack* s, const char* var) {
-    for (ptrdiff_t i = s->len - 1; i >= 0; i--) {
-        const json_value* out;
-        if (hashmap_get(&s->frames[i].data, var, (const void**)&out)) {
-            return out;
-        }
+// returns NULL if the slot was never set
+const json_value* stack_get(const stack* s, size_t slot) {
+    size_t idx = s->base + slot;
+    if (idx >= s->len) {
+        return NULL;
     }
-    return NULL;
+    return &s->slots[idx].val;
 }
 
 #define STATE_IDENT_CAP 128
@@ -131,19 +100,229 @@ const json_value* stack_find_var(stack* s, const char* var) {
 #define RETURN_REASON_BREAK 3
 #define RETURN_REASON_CONTINUE 4
 
+#define DEFAULT_FUNC_ARGS_CAP 4
+
+#define EXPR_LITERAL 1
+#define EXPR_FIELD 2
+#define EXPR_VAR 3
+#define EXPR_DECLARE 4
+#define EXPR_ASSIGN 5
+#define EXPR_CALL 6
+
+typedef struct template_expr_st {
+    int ty;
+    // set on the leading value of a top-level pipeline
+    bool no_nil;
+    union {
+        json_value literal;
+        struct {
+            size_t len;
+            char** keys;
+            // precomputed json_key_hash of keys
+            size_t* hashes;
+        } field;
+        // slot of the variable
+        size_t var;
+        struct {
+            size_t slot;
+            struct template_expr_st* value;
+        } mutation;
+        struct {
+            funcptr f;
+            struct template_expr_st* piped;
+            size_t args_len;
+            struct template_expr_st** args;
+        } call;
+    } inner;
+} template_expr;
+
+#define NODE_TEXT 1
+#define NODE_ACTION 2
+#define NODE_MUTATION 3
+#define NODE_IF 4
+#define NODE_WITH 5
+#define NODE_RANGE 6
+#define NODE_TEMPLATE 7
+#define NODE_BREAK 8
+#define NODE_CONTINUE 9
+
+typedef struct template_node_st {
+    int ty;
+    struct template_node_st* next;
+    union {
+        struct {
+            size_t len;
+            char* data;
+        } text;
+        template_expr* expr;
+        struct {
+            template_expr* cond;
+            struct template_node_st* body;
+            struct template_node_st* else_body;
+            // set if cond may refer to a variable, which body reassigns
+            bool pin;
+        } branch;
+        struct {
+            template_expr* iterable;
+            char* key_name;
+            char* value_name;
+            size_t key_slot;
+            size_t value_slot;
+            // set if iterable may refer to a variable, which body reassigns
+            bool pin;
+            struct template_node_st* body;
+            struct template_node_st* else_body;
+        } range;
+        struct {
+            char* name;
+            template_expr* arg;
+            // set once the name is resolved to a define after compilation
+            bool linked;
+            const struct template_node_st* target;
+        } call;
+    } inner;
+} template_node;
+
+template_expr* template_expr_new(int ty) {
+    template_expr* expr = malloc(sizeof(template_expr));
+    assert(expr);
+    expr->ty = ty;
+    expr->no_nil = false;
+    return expr;
+}
+
+void template_expr_free(template_expr* expr) {
+    if (expr == NULL) {
+        return;
+    }
+    switch (expr->ty) {
+        case EXPR_LITERAL:
+            json_value_free(&expr->inner.literal);
+            break;
+        case EXPR_FIELD:
+            for (size_t i = 0; i < expr->inner.field.len; i++) {
+                free(expr->inner.field.keys[i]);
+            }
+            free(expr->inner.field.keys);
+            free(expr->inner.field.hashes);
+            break;
+        case EXPR_DECLARE:
+        case EXPR_ASSIGN:
+            template_expr_free(expr->inner.mutation.value);
+            break;
+        case EXPR_CALL:
+            template_expr_free(expr->inner.call.piped);
+            for (size_t i = 0; i < expr->inner.call.args_len; i++) {
+                template_expr_free(expr->inner.call.args[i]);
+            }
+            free(expr->inner.call.args);
+            break;
+    }
+    free(expr);
+}
+
+template_node* template_node_new(int ty) {
+    template_node* node = calloc(1, sizeof(template_node));
+    assert(node);
+    node->ty = ty;
+    return node;
+}
+
+// frees node and all nodes following it
+void template_node_free(template_node* node) {
+    while (node != NULL) {
+        template_node* next = node->next;
+        switch (node->ty) {
+            case NODE_TEXT:
+                free(node->inner.text.data);
+                break;
+            case NODE_ACTION:
+            case NODE_MUTATION:
+                template_expr_free(node->inner.expr);
+                break;
+            case NODE_IF:
+            case NODE_WITH:
+                template_expr_free(node->inner.branch.cond);
+                template_node_free(node->inner.branch.body);
+                template_node_free(node->inner.branch.else_body);
+                break;
+            case NODE_RANGE:
+                template_expr_free(node->inner.range.iterable);
+                free(node->inner.range.key_name);
+                free(node->inner.range.value_name);
+                template_node_free(node->inner.range.body);
+                template_node_free(node->inner.range.else_body);
+                break;
+            case NODE_TEMPLATE:
+                free(node->inner.call.name);
+                template_expr_free(node->inner.call.arg);
+                break;
+        }
+        free(node);
+        node = next;
+    }
+}
+
 typedef struct {
-    json_value* dot;
-    buf out;
-    size_t out_nospace;
+    hashmap* defines;
+    const hashmap* funcmap;
+    // text node directly preceding the current pipeline, if any
+    template_node* last_text;
     size_t range_depth;
-    stack stack;
-    hashmap define_locs;
-    hashmap funcmap;
+    bool in_define;
     int return_reason;
+    // names of the variables in scope, innermost last
+    char** vars;
+    size_t vars_len;
+    size_t vars_cap;
+    // variables before this index are hidden, the first
+    // visible one is stored in slot 0
+    size_t vars_visible;
+    // most slots any single body needs at once
+    size_t slots;
+    // counts parsed variable references and assignments to tell
+    // whether a body may reassign a variable its pipeline refers to
+    size_t var_refs;
+    size_t var_assigns;
     char ident[STATE_IDENT_CAP];
-    bool eval_block;
-    bool eval_arg;
-} state;
+} parser;
+
+#define DEFAULT_VARS_CAP 8
+
+// returns the slot of the declared variable
+size_t parser_declare_var(parser* p, const char* var) {
+    if (p->vars_len == p->vars_cap) {
+        p->vars_cap = p->vars_cap < DEFAULT_VARS_CAP ? DEFAULT_VARS_CAP : p->vars_cap * 3 / 2;
+        p->vars = realloc(p->vars, sizeof(char*) * p->vars_cap);
+        assert(p->vars);
+    }
+    p->vars[p->vars_len] = strdup(var);
+    p->vars_len++;
+    size_t slots = p->vars_len - p->vars_visible;
+    if (slots > p->slots) {
+        p->slots = slots;
+    }
+    return slots - 1;
+}
+
+// looks up the innermost visible variable named var and stores its slot
+bool parser_find_var(const parser* p, const char* var, size_t* slot) {
+    for (size_t i = p->vars_len; i > p->vars_visible; i--) {
+        if (strcmp(p->vars[i - 1], var) == 0) {
+            *slot = i - 1 - p->vars_visible;
+            return true;
+        }
+    }
+    return false;
+}
+
+// drops all variables declared after the scope was entered with len vars
+void parser_leave_scope(parser* p, size_t len) {
+    while (p->vars_len > len) {
+        p->vars_len--;
+        free(p->vars[p->vars_len]);
+    }
+}
 
 int template_skip_whitespace(stream* in) {
     unsigned char cp[4];
@@ -181,7 +360,7 @@ int template_next_nonspace(stream* in, unsigned char* cp, size_t* cp_len) {
 int template_parse_number(stream* in, double* out) {
     unsigned char cp[4];
     size_t cp_len;
-    char buf[128];
+    char buf[JSON_NUMBER_CAP];
     size_t buf_idx = 0;
     while (buf_idx < sizeof(buf)) {
         int err = stream_next_utf8_cp(in, cp, &cp_len);
@@ -192,11 +371,21 @@ int template_parse_number(stream* in, double* out) {
             return ERR_TEMPLATE_INVALID_SYNTAX;
         }
         if (!isalnum(cp[0]) && cp[0] != '+' && cp[0] != '-' && cp[0] != '.') {
+            // literals in JSON syntax are converted like JSON numbers,
+            // strtod handles the rest like leading zeros or hex
+            size_t sign = buf_idx > 0 && buf[0] == '-';
+            if (buf_idx > sign && isdigit((unsigned char)buf[sign]) && json_number_convert(buf[sign], (const unsigned char*)buf + sign + 1, buf_idx - sign - 1, out) == 0) {
+                // like strtod below, -0 is printed as 0
+                if (sign && *out != 0) {
+                    *out = -*out;
+                }
+                return stream_seek(in, -1);
+            }
             buf[buf_idx] = 0;
             char* end;
+            errno = 0;
             *out = strtod(buf, &end);
             if (errno == ERANGE) {
-                errno = 0;
                 return ERR_TEMPLATE_INVALID_SYNTAX;
             }
             if (buf == end) {
@@ -330,7 +519,7 @@ cleanup:
     return err;
 }
 
-int template_parse_ident(stream* in, state* state) {
+int template_parse_ident(stream* in, parser* p) {
     unsigned char cp[4];
     size_t cp_len;
     int err = 0;
@@ -343,102 +532,71 @@ int template_parse_ident(stream* in, state* state) {
             return ERR_TEMPLATE_INVALID_SYNTAX;
         }
         if (!isalnum(cp[0])) {
-            state->ident[i] = 0;
+            p->ident[i] = 0;
             return stream_seek(in, -1);
         }
-        state->ident[i] = cp[0];
+        p->ident[i] = cp[0];
     }
     return ERR_BUF_OVERFLOW;
 }
 
-int template_skip_path_expr(stream* in) {
+// '.' is already consumed
+int template_parse_path_expr(stream* in, parser* p, template_expr** out) {
+    *out = NULL;
+    int err = template_parse_ident(in, p);
+    if (err) {
+        return err;
+    }
+    template_expr* expr = template_expr_new(EXPR_FIELD);
+    expr->inner.field.len = 0;
+    expr->inner.field.keys = NULL;
+    expr->inner.field.hashes = NULL;
+    if (strlen(p->ident) == 0) {
+        *out = expr;
+        return 0;
+    }
     unsigned char cp[4];
     size_t cp_len;
     while (true) {
-        int err = stream_next_utf8_cp(in, cp, &cp_len);
+        expr->inner.field.keys = realloc(expr->inner.field.keys, sizeof(char*) * (expr->inner.field.len + 1));
+        assert(expr->inner.field.keys);
+        expr->inner.field.keys[expr->inner.field.len] = strdup(p->ident);
+        expr->inner.field.hashes = realloc(expr->inner.field.hashes, sizeof(size_t) * (expr->inner.field.len + 1));
+        assert(expr->inner.field.hashes);
+        expr->inner.field.hashes[expr->inner.field.len] = json_key_hash(p->ident);
+        expr->inner.field.len++;
+        err = stream_next_utf8_cp(in, cp, &cp_len);
         if (err) {
-            return err;
+            goto cleanup;
         }
         if (cp_len != 1) {
-            continue;
+            err = ERR_TEMPLATE_INVALID_SYNTAX;
+            goto cleanup;
         }
-        if (!isalnum(cp[0]) && cp[0] != '.') {
-            break;
+        if (cp[0] != '.') {
+            err = stream_seek(in, -1);
+            goto cleanup;
         }
-    }
-    return stream_seek(in, -1);
-}
-
-int template_parse_path_expr_recurse(stream* in, state* state, json_value* result) {
-    unsigned char cp[4];
-    size_t cp_len;
-    int err = stream_next_utf8_cp(in, cp, &cp_len);
-    if (err) {
-        return err;
-    }
-    if (cp_len != 1) {
-        return ERR_TEMPLATE_INVALID_SYNTAX;
-    }
-    if (cp[0] != '.') {
-        *result = *state->dot;
-        return stream_seek(in, -1);
-    }
-    err = template_parse_ident(in, state);
-    if (err) {
-        return err;
-    }
-    if (strlen(state->ident) == 0) {
-        return ERR_TEMPLATE_INVALID_SYNTAX;
-    }
-    if (state->dot->ty != JSON_TY_OBJECT) {
-        return ERR_TEMPLATE_NO_OBJECT;
-    }
-    json_value* next;
-    int found = hashmap_get(&state->dot->inner.obj, state->ident, (const void**)&next);
-    if (!found) {
-        err = template_skip_path_expr(in);
+        err = template_parse_ident(in, p);
         if (err) {
-            return err;
+            goto cleanup;
+        }
+        if (strlen(p->ident) == 0) {
+            err = ERR_TEMPLATE_INVALID_SYNTAX;
+            goto cleanup;
         }
-        return ERR_TEMPLATE_KEY_UNKNOWN;
     }
-    json_value* current = state->dot;
-    state->dot = next;
-    err = template_parse_path_expr_recurse(in, state, result);
-    state->dot = current;
-    return err;
-}
-
-int template_parse_path_expr(stream* in, state* state, json_value* result) {
-    *result = JSON_NULL;
-    int err = template_parse_ident(in, state);
+cleanup:
     if (err) {
+        template_expr_free(expr);
         return err;
     }
-    if (strlen(state->ident) == 0) {
-        *result = *state->dot;
-        return 0;
-    }
-    if (state->dot->ty != JSON_TY_OBJECT) {
-        return ERR_TEMPLATE_NO_OBJECT;
-    }
-    json_value* next;
-    int found = hashmap_get(&state->dot->inner.obj, state->ident, (const void**)&next);
-    if (!found) {
-        err = template_skip_path_expr(in);
-        if (err) {
-            return err;
-        }
-        return ERR_TEMPLATE_KEY_UNKNOWN;
-    }
-    json_value* current = state->dot;
-    state->dot = next;
-    err = template_parse_path_expr_recurse(in, state, result);
-    state->dot = current;
-    return err;
+    *out = expr;
+    return 0;
 }
 
-int template_parse_var_value(stream* in, state* state, json_value* result) {
+int template_parse_var_value(stream* in, parser* p, template_expr** out) {
+    *out = NULL;
     unsigned char cp[4];
     size_t cp_len;
     int err = stream_next_utf8_cp(in, cp, &cp_len);
@@ -450,98 +608,104 @@ int template_parse_var_value(stream* in, state* state, json_value* result) {
         if (err) {
             return err;
         }
-        err = template_parse_ident(in, state);
+        err = template_parse_ident(in, p);
         if (err) {
             return err;
         }
     } else {  // '$' var
-        state->ident[0] = 0;
+        p->ident[0] = 0;
     }
-    const json_value* out = stack_find_var(&state->stack, state->ident);
-    if (out == NULL) {
+    size_t slot;
+    if (!parser_find_var(p, p->ident, &slot)) {
         return ERR_TEMPLATE_VAR_UNKNOWN;
     }
-    *result = *out;
+    p->var_refs++;
+    template_expr* expr = template_expr_new(EXPR_VAR);
+    expr->inner.var = slot;
+    *out = expr;
+    return 0;
+}
+
+int template_parse_literal(template_expr** out, json_value val) {
+    template_expr* expr = template_expr_new(EXPR_LITERAL);
+    expr->inner.literal = val;
+    *out = expr;
     return 0;
 }
 
 // seeks back in-front of first when returning ERR_TEMPLATE_NO_VALUE
-int template_parse_value(stream* in, state* state, tracked_value* result, unsigned char first) {
+int template_parse_value(stream* in, parser* p, template_expr** out, unsigned char first) {
     unsigned char cp[4];
     size_t cp_len;
     int err = 0;
-    double val;
+    json_value val = JSON_NULL;
     size_t seek_back = -1;
     size_t identifier_len = 0;
-    tracked_value_free(result);
-    result->is_heap = false;
+    *out = NULL;
     switch (first) {
         case 't':
-            err = template_parse_ident(in, state);
+            err = template_parse_ident(in, p);
             if (err) {
                 return err;
             }
-            bool is_true = strcmp("rue", state->ident) == 0;
+            bool is_true = strcmp("rue", p->ident) == 0;
             if (is_true) {
-                result->val.ty = JSON_TY_TRUE;
-                return 0;
+                val.ty = JSON_TY_TRUE;
+                return template_parse_literal(out, val);
             }
-            identifier_len = strlen(state->ident);
+            identifier_len = strlen(p->ident);
             err = stream_seek(in, -identifier_len - 1);
             if (err) {
                 return err;
             }
             return ERR_TEMPLATE_NO_VALUE;
         case 'f':
-            err = template_parse_ident(in, state);
+            err = template_parse_ident(in, p);
             if (err) {
                 return err;
             }
-            bool is_false = strcmp("alse", state->ident) == 0;
+            bool is_false = strcmp("alse", p->ident) == 0;
             if (is_false) {
-                result->val.ty = JSON_TY_FALSE;
-                return 0;
+                val.ty = JSON_TY_FALSE;
+                return template_parse_literal(out, val);
             }
-            identifier_len = strlen(state->ident);
+            identifier_len = strlen(p->ident);
             err = stream_seek(in, -identifier_len - 1);
             if (err) {
                 return err;
             }
             return ERR_TEMPLATE_NO_VALUE;
         case 'n':
-            err = template_parse_ident(in, state);
+            err = template_parse_ident(in, p);
             if (err) {
                 return err;
             }
-            bool is_nil = strcmp("il", state->ident) == 0;
+            bool is_nil = strcmp("il", p->ident) == 0;
             if (is_nil) {
-                result->val.ty = JSON_TY_NULL;
-                return 0;
+                return template_parse_literal(out, val);
             }
-            identifier_len = strlen(state->ident);
+            identifier_len = strlen(p->ident);
             err = stream_seek(in, -identifier_len - 1);
             if (err) {
                 return err;
             }
             return ERR_TEMPLATE_NO_VALUE;
         case '$':
-            return template_parse_var_value(in, state, &result->val);
+            return template_parse_var_value(in, p, out);
         case '"':
-            err = template_parse_regular_str(in, &result->val.inner.str);
+            err = template_parse_regular_str(in, &val.inner.str);
             if (err) {
                 return err;
             }
-            result->val.ty = JSON_TY_STRING;
-            result->is_heap = true;
-            return 0;
+            val.ty = JSON_TY_STRING;
+            return template_parse_literal(out, val);
         case '`':
-            err = template_parse_backtick_str(in, &result->val.inner.str);
+            err = template_parse_backtick_str(in, &val.inner.str);
             if (err) {
                 return err;
             }
-            result->val.ty = JSON_TY_STRING;
-            result->is_heap = true;
-            return 0;
+            val.ty = JSON_TY_STRING;
+            return template_parse_literal(out, val);
         case '-':
             err = stream_next_utf8_cp(in, cp, &cp_len);
             if (err) {
@@ -577,10 +741,14 @@ int template_parse_value(stream* in, state* state, tracked_value* result, unsign
             if (err) {
                 return err;
             }
-            result->val.ty = JSON_TY_NUMBER;
-            return template_parse_number(in, &result->val.inner.num);
+            val.ty = JSON_TY_NUMBER;
+            err = template_parse_number(in, &val.inner.num);
+            if (err) {
+                return err;
+            }
+            return template_parse_literal(out, val);
         case '.':
-            return template_parse_path_expr(in, state, &result->val);
+            return template_parse_path_expr(in, p, out);
         default:
             err = stream_seek(in, -1);
             if (err) {
@@ -593,10 +761,12 @@ int template_parse_value(stream* in, state* state, tracked_value* result, unsign
 #define TEMPLATE_PARSE_EXPR_NO_VAR_MUT 0x01
 #define TEMPLATE_PARSE_EXPR_NO_PIPE 0x02
 #define TEMPLATE_PARSE_EXPR_FORCE_SPACE 0x04
+#define TEMPLATE_PARSE_EXPR_NO_ARGS 0x08
 
-int template_parse_expr(stream* in, state* state, tracked_value* result, int flags);
+int template_parse_expr(stream* in, parser* p, template_expr** out, int flags);
 
-int template_parse_var_mutation(stream* in, state* state, tracked_value* result) {
+int template_parse_var_mutation(stream* in, parser* p, template_expr** out) {
+    *out = NULL;
     unsigned char cp[4];
     size_t cp_len;
     // parse var name
@@ -609,7 +779,7 @@ int template_parse_var_mutation(stream* in, state* state, tracked_value* result)
         if (err) {
             return err;
         }
-        err = template_parse_ident(in, state);
+        err = template_parse_ident(in, p);
         if (err) {
             return err;
         }
@@ -618,7 +788,7 @@ int template_parse_var_mutation(stream* in, state* state, tracked_value* result)
             return err;
         }
     } else {  // '$' var
-        state->ident[0] = 0;
+        p->ident[0] = 0;
     }
     if (cp[0] == '=') { // enforce space for assignments
         return ERR_TEMPLATE_INVALID_SYNTAX;
@@ -649,48 +819,44 @@ int template_parse_var_mutation(stream* in, state* state, tracked_value* result)
         default:
             return ERR_TEMPLATE_NO_MUTATION;
     }
-    const json_value* current_val = stack_find_var(&state->stack, state->ident);
-    if (current_val == NULL && is_assignment) {
+    size_t slot;
+    if (is_assignment && !parser_find_var(p, p->ident, &slot)) {
         return ERR_TEMPLATE_VAR_UNKNOWN;
     }
     err = template_skip_whitespace(in);
     if (err) {
         return err;
     }
-    char* ident_copy = strdup(state->ident);
-    err = template_parse_expr(in, state, result, TEMPLATE_PARSE_EXPR_NO_VAR_MUT);  // result holds right side of assignment
+    char* ident_copy = strdup(p->ident);
+    template_expr* value;
+    err = template_parse_expr(in, p, &value, TEMPLATE_PARSE_EXPR_NO_VAR_MUT);  // right side of assignment
     if (err) {
         free(ident_copy);
         return err;
     }
-    // nil cannot be assigned in go
-    if (result->val.ty == JSON_TY_NULL) {
-        free(ident_copy);
-        return ERR_TEMPLATE_KEYWORD_UNEXPECTED;
-    }
-    json_value* value_copy = malloc(sizeof(json_value));
-    assert(value_copy);
-    if (result->is_heap) {
-        *value_copy = result->val;
+    if (is_assignment) {
+        p->var_assigns++;
     } else {
-        // in case of $var=$var the second $var would be returned as result, although
-        // it is freed in stack_set_var
-        json_value_copy(value_copy, &result->val);
-        result->val = *value_copy;
-    }
-    result->is_heap = false;
-    stack_set_var(&state->stack, ident_copy, value_copy);
+        slot = parser_declare_var(p, ident_copy);
+    }
+    free(ident_copy);
+    // the result of a mutation is the variable's value
+    p->var_refs++;
+    template_expr* expr = template_expr_new(is_assignment ? EXPR_ASSIGN : EXPR_DECLARE);
+    expr->inner.mutation.slot = slot;
+    expr->inner.mutation.value = value;
+    *out = expr;
     return 0;
 }
 
-int template_parse_value_with_var_mut(stream* in, state* state, tracked_value* result, unsigned char first) {
+int template_parse_value_with_var_mut(stream* in, parser* p, template_expr** out, unsigned char first) {
     if (first == '$') {
         long pre_pos;
         int err = stream_pos(in, &pre_pos);
         if (err) {
             return err;
         }
-        err = template_parse_var_mutation(in, state, result);
+        err = template_parse_var_mutation(in, p, out);
         if (err != ERR_TEMPLATE_NO_MUTATION) {
             return err;
         }
@@ -699,18 +865,17 @@ int template_parse_value_with_var_mut(stream* in, state* state, tracked_value* r
             return err;
         }
     }
-    return template_parse_value(in, state, result, first);
+    return template_parse_value(in, p, out, first);
 }
 
-int template_parse_parenthesis(stream* in, state* state, tracked_value* result) {
+int template_parse_parenthesis(stream* in, parser* p, template_expr** out) {
+    *out = NULL;
     int err = template_skip_whitespace(in);
     if (err) {
         return err;
     }
-    bool old_eval_arg = state->eval_arg;
-    state->eval_arg = false;
-    err = template_parse_expr(in, state, result, 0);
-    state->eval_arg = old_eval_arg;
+    template_expr* expr;
+    err = template_parse_expr(in, p, &expr, 0);
     if (err) {
         return err;
     }
@@ -718,17 +883,119 @@ int template_parse_parenthesis(stream* in, state* state, tracked_value* result)
     size_t cp_len;
     err = template_next_nonspace(in, cp, &cp_len);
     if (err) {
+        template_expr_free(expr);
         return err;
     }
     if (cp_len != 1 || cp[0] != ')') {
+        template_expr_free(expr);
         return ERR_TEMPLATE_INVALID_SYNTAX;
     }
+    *out = expr;
     return 0;
 }
 
-int template_dispatch_func(stream* in, state* state, tracked_value* piped, tracked_value* result);
+int template_parse_arg(stream* in, parser* p, template_expr** out) {
+    int err = template_parse_expr(in, p, out, TEMPLATE_PARSE_EXPR_NO_PIPE | TEMPLATE_PARSE_EXPR_NO_VAR_MUT | TEMPLATE_PARSE_EXPR_NO_ARGS);
+    if (err) {
+        return err;
+    }
+    // check that the next char is something an argument list would split at
+    // to ensure that the arg was fully consumed, without such a check stuff like
+    // '$#' would return '$' due to the '#' never being read and hence not producing
+    // an ERR_TEMPLATE_INVALID_SYNTAX.
+    unsigned char cp[4];
+    size_t cp_len;
+    err = stream_next_utf8_cp(in, cp, &cp_len);
+    if (err) {
+        goto cleanup;
+    }
+    if (cp_len != 1 || !(isspace(cp[0]) || cp[0] == ')' || cp[0] == '}' || cp[0] == '|')) {
+        err = ERR_TEMPLATE_INVALID_SYNTAX;
+        goto cleanup;
+    }
+    err = stream_seek(in, -cp_len);
+cleanup:
+    if (err) {
+        template_expr_free(*out);
+        *out = NULL;
+    }
+    return err;
+}
+
+// piped is owned by the result on success only
+int template_parse_func(stream* in, parser* p, template_expr* piped, bool with_args, template_expr** out) {
+    *out = NULL;
+    int err = template_parse_ident(in, p);
+    if (err) {
+        return err;
+    }
+    char func_name[STATE_IDENT_CAP];
+    strcpy(func_name, p->ident);
+    template_expr* expr = template_expr_new(EXPR_CALL);
+    expr->inner.call.piped = NULL;
+    expr->inner.call.args_len = 0;
+    expr->inner.call.args = NULL;
+    size_t args_cap = 0;
+    unsigned char cp[4];
+    size_t cp_len;
+    // when evaluating a function directly passed as an argument
+    // to another function it is always evaluated with zero args
+    while (with_args) {
+        err = stream_next_utf8_cp(in, cp, &cp_len);
+        if (err) {
+            goto cleanup;
+        }
+        if (cp_len != 1) {
+            err = ERR_TEMPLATE_INVALID_SYNTAX;
+            goto cleanup;
+        }
+        if (!(isspace(cp[0]) || cp[0] == ')' || cp[0] == '}' || cp[0] == '|')) {
+            err = ERR_TEMPLATE_INVALID_SYNTAX;
+            goto cleanup;
+        }
+        err = stream_seek(in, -cp_len);
+        if (err) {
+            goto cleanup;
+        }
+        template_expr* arg;
+        err = template_parse_arg(in, p, &arg);
+        if (err == ERR_TEMPLATE_NO_VALUE) {
+            err = 0;
+            break;
+        }
+        if (err) {
+            goto cleanup;
+        }
+        if (expr->inner.call.args_len == args_cap) {
+            args_cap = args_cap == 0 ? DEFAULT_FUNC_ARGS_CAP : args_cap * 3 / 2;
+            expr->inner.call.args = realloc(expr->inner.call.args, args_cap * sizeof(template_expr*));
+            assert(expr->inner.call.args);
+        }
+        expr->inner.call.args[expr->inner.call.args_len] = arg;
+        expr->inner.call.args_len++;
+    }
+    // the arguments are fixed from now on, so drop the excess capacity
+    if (expr->inner.call.args_len != 0 && expr->inner.call.args_len != args_cap) {
+        expr->inner.call.args = realloc(expr->inner.call.args, expr->inner.call.args_len * sizeof(template_expr*));
+        assert(expr->inner.call.args);
+    }
+    int found = hashmap_get(p->funcmap, func_name, (const void**)&expr->inner.call.f);
+    if (!found) {
+        err = ERR_TEMPLATE_FUNC_UNKNOWN;
+        goto cleanup;
+    }
+    expr->inner.call.piped = piped;
+cleanup:
+    if (err) {
+        template_expr_free(expr);
+        return err;
+    }
+    *out = expr;
+    return 0;
+}
 
-int template_parse_pipe(stream* in, state* state, tracked_value* result) {
+// replaces result with a call of the piped function, if any
+int template_parse_pipe(stream* in, parser* p, template_expr** result) {
     unsigned char cp[4];
     size_t cp_len;
     int err = template_next_nonspace(in, cp, &cp_len);
@@ -745,25 +1012,17 @@ int template_parse_pipe(stream* in, state* state, tracked_value* result) {
     if (err) {
         return err;
     }
-    tracked_value last = *result;
-    if (!result->is_heap) {
-        // a non-help allocated value may originate from the stack
-        // whose pointer would be invalidated if a function argument
-        // does assign another value to the same variable, as in e.g.
-        // {{ $=($="a") | print ($=3) }}.
-        json_value_copy(&last.val, &result->val);
-        tracked_value_free(result);
-        last.is_heap = true;
-    }
-    *result = TRACKED_NULL;
-    err = template_dispatch_func(in, state, &last, result);
+    template_expr* call;
+    err = template_parse_func(in, p, *result, true, &call);
     if (err) {
         return err;
     }
-    return template_parse_pipe(in, state, result);
+    *result = call;
+    return template_parse_pipe(in, p, result);
 }
 
-int template_parse_expr(stream* in, state* state, tracked_value* result, int flags) {
+int template_parse_expr(stream* in, parser* p, template_expr** out, int flags) {
+    *out = NULL;
     unsigned char cp[4];
     size_t cp_len;
     int err = 0;
@@ -791,62 +1050,39 @@ int template_parse_expr(stream* in, state* state, tracked_value* result, int fla
     if (cp_len != 1) {
         return ERR_TEMPLATE_INVALID_SYNTAX;
     }
+    template_expr* expr;
     if (cp[0] == '(') {
-        err = template_parse_parenthesis(in, state, result);
-        if (err) {
-            return err;
-        }
-        if (flags & TEMPLATE_PARSE_EXPR_NO_PIPE) {
-            return 0;
-        }
-        return template_parse_pipe(in, state, result);
-    }
-    if (flags & TEMPLATE_PARSE_EXPR_NO_VAR_MUT) {
-        err = template_parse_value(in, state, result, cp[0]);
+        err = template_parse_parenthesis(in, p, &expr);
     } else {
-        err = template_parse_value_with_var_mut(in, state, result, cp[0]);
-    }
-    if (err == 0) {
-        if (flags & TEMPLATE_PARSE_EXPR_NO_PIPE) {
-            return 0;
+        if (flags & TEMPLATE_PARSE_EXPR_NO_VAR_MUT) {
+            err = template_parse_value(in, p, &expr, cp[0]);
+        } else {
+            err = template_parse_value_with_var_mut(in, p, &expr, cp[0]);
+        }
+        if (err == ERR_TEMPLATE_NO_VALUE) {
+            if (!isalpha(cp[0])) {
+                // template_parse_expr() is invoked by template_parse_func().
+                // The latter stops parsing arguments on ERR_TEMPLATE_NO_VALUE.
+                return ERR_TEMPLATE_NO_VALUE;
+            }
+            err = template_parse_func(in, p, NULL, !(flags & TEMPLATE_PARSE_EXPR_NO_ARGS), &expr);
         }
-        return template_parse_pipe(in, state, result);
-    }
-    if (err != ERR_TEMPLATE_NO_VALUE) {
-        return err;
-    }
-    if (!isalpha(cp[0])) {
-        // template_parse_expr() is invoked by template_dispatch_func().
-        // The latter stops parsing arguments on ERR_TEMPLATE_NO_VALUE.
-        return ERR_TEMPLATE_NO_VALUE;
     }
-    err = template_dispatch_func(in, state, NULL, result);
     if (err) {
         return err;
     }
-    if (flags & TEMPLATE_PARSE_EXPR_NO_PIPE) {
-        return 0;
+    if (!(flags & TEMPLATE_PARSE_EXPR_NO_PIPE)) {
+        err = template_parse_pipe(in, p, &expr);
+        if (err) {
+            template_expr_free(expr);
+            return err;
+        }
     }
-    return template_parse_pipe(in, state, result);
+    *out = expr;
+    return 0;
 }
 
-int template_parse_arg(stream* in, state* state, tracked_value* arg) {
-    unsigned char cp[4];
-    size_t cp_len;
-    int err = template_next_nonspace(in, cp, &cp_len);
-    if (err) {
-        return err;
-    }
-    if (cp_len != 1) {
-        return ERR_TEMPLATE_INVALID_SYNTAX;
-    }
-    if (cp[0] == '(') {
-        return template_parse_parenthesis(in, state, arg);
-    }
-    return template_parse_value_with_var_mut(in, state, arg, cp[0]);
-}
-
-int template_end_pipeline(stream* in, state* state, json_value* result) {
+int template_end_pipeline(stream* in) {
     unsigned char cp[4];
     size_t cp_len;
     int err = template_next_nonspace(in, cp, &cp_len);
@@ -876,12 +1112,6 @@ int template_end_pipeline(stream* in, state* state, json_value* result) {
             if (cp_len != 1 || cp[0] != '}') {
                 return ERR_TEMPLATE_INVALID_SYNTAX;
             }
-            if (result->ty != JSON_TY_NULL) {
-                err = sprintval(&state->out, result, NULL_STR_NIL);
-                if (err) {
-                    return err;
-                }
-            }
             if (trim) {
                 err = template_skip_whitespace(in);
                 if (err == ERR_TEMPLATE_UNEXPECTED_EOF) {
@@ -897,29 +1127,6 @@ int template_end_pipeline(stream* in, state* state, json_value* result) {
     }
 }
 
-int template_parse_noop_ident(stream* in, state* state, char leading) {
-    unsigned char cp[4];
-    size_t cp_len;
-    int err = 0;
-    state->ident[0] = leading;
-    for (size_t i = 1; i < STATE_IDENT_CAP; i++) {
-        err = stream_next_utf8_cp(in, cp, &cp_len);
-        if (err) {
-            return err;
-        }
-        if (cp_len != 1) {
-            return ERR_TEMPLATE_INVALID_SYNTAX;
-        }
-        bool keep = isalnum(cp[0]) || cp[0] == '.' || cp[0] == '$' || cp[0] == '|' || cp[0] == '(' || cp[0] == ')';
-        if (!keep) {
-            state->ident[i] = 0;
-            return stream_seek(in, -1);
-        }
-        state->ident[i] = cp[0];
-    }
-    return ERR_BUF_OVERFLOW;
-}
-
 int template_parse_define_name(stream* in, char** name) {
     unsigned char cp[4];
     size_t cp_len;
@@ -950,844 +1157,327 @@ int template_parse_define_name(stream* in, char** name) {
     return err;
 }
 
-// 2 cases:
-// - opening parenthesis => skip everything, consuming closing parenthesis => done
-// - no paranthesis (any space, brace, paren, pipe is terminal)
-//   - value <space> => trivial
-//   - value <terminal> => seek back => the next invocation needs to see the terminal
-// both cases are entwined here
-// - depth == 0 is unreachable with an opening paren, causing everything to to skipped except except the last closing paren
-int template_skip_expr(stream* in, long* start_pos) {
+int template_skip_comment(stream* in) {
     unsigned char cp[4];
     size_t cp_len;
-    int err = template_next_nonspace(in, cp, &cp_len);
-    if (err) {
-        return err;
-    }
-    err = stream_pos(in, start_pos);
-    if (err) {
-        return err;
-    }
-    (*start_pos) -= cp_len;
-    size_t depth = 0;
-    bool opening_paren = false;
-    if (cp_len == 1) {
-        if (cp[0] == ')' || cp[0] == '}' || cp[0] == '|') {
-            return ERR_TEMPLATE_NO_VALUE;
-        }
-        if (cp[0] == '"') {
-            char* str;
-            err = template_parse_regular_str(in, &str);
-            if (err) {
-                return err;
-            }
-            free(str);
-            return 0;
-        }
-        if (cp[0] == '`') {
-            char* str;
-            err = template_parse_backtick_str(in, &str);
-            if (err) {
-                return err;
-            }
-            free(str);
-            return 0;
-        }
-        if (cp[0] == '(') {
-            opening_paren = true;
-            depth++;
-        }
-    }
     while (true) {
         int err = stream_next_utf8_cp(in, cp, &cp_len);
         if (err) {
             return err;
         }
-        if (cp_len != 1) {
-            continue;
-        }
-        if (depth == 0) {
-            if (isspace(cp[0]) || cp[0] == ')' || cp[0] == '|') {
-                return stream_seek(in, -cp_len);
-            }
-            if (cp[0] == '"' || cp[0] == '`') {
-                return ERR_TEMPLATE_INVALID_SYNTAX;
-            }
-        }
-        if (cp[0] == ')') {
-            if (opening_paren && depth == 1) {
-                return 0;
-            }
-            depth--;
-            continue;
-        }
-        if (cp[0] == '}') {
-            return ERR_TEMPLATE_NO_VALUE;
-        }
-        if (cp[0] == '"') {
-            char* str;
-            err = template_parse_regular_str(in, &str);
-            if (err) {
-                return err;
-            }
-            free(str);
-            continue;
-        }
-        if (cp[0] == '`') {
-            char* str;
-            err = template_parse_backtick_str(in, &str);
-            if (err) {
-                return err;
-            }
-            free(str);
-            continue;
-        }
-        if (cp[0] == '(') {
-            depth++;
+        if (cp_len != 1 || cp[0] != '*') {
             continue;
         }
-    }
-}
-
-int template_pipeline_noop_register_block(stream* in, state* state) {
-    char* name;
-    int err = template_parse_define_name(in, &name);
-    if (err) {
-        return err;
-    }
-    unsigned char cp[4];
-    size_t cp_len;
-    err = stream_next_utf8_cp(in, cp, &cp_len);
-    if (err) {
-        goto cleanup;
-    }
-    if (cp_len != 1 || !isspace(cp[0])) {
-        err = ERR_TEMPLATE_INVALID_SYNTAX;
-        goto cleanup;
-    }
-    err = template_skip_whitespace(in);
-    if (err) {
-        goto cleanup;
-    }
-    long discard;
-    err = template_skip_expr(in, &discard);
-    if (err) {
-        goto cleanup;
-    }
-    long pre_end;
-    err = stream_pos(in, &pre_end);
-    if (err) {
-        goto cleanup;
-    }
-    json_value nothing = JSON_NULL;
-    err = template_end_pipeline(in, state, &nothing);
-    if (err) {
-        goto cleanup;
-    }
-    long pos;
-    err = stream_pos(in, &pos);
-    if (err) {
-        goto cleanup;
-    }
-    assert(sizeof(long) == sizeof(void*));
-    entry previous = hashmap_insert(&state->define_locs, name, (void*)pos);
-    if (previous.exists) {
-        free(previous.key);
-    }
-    err = stream_set_pos(in, pre_end);
-    if (err) {
-        return err;
-    }
-cleanup:
-    if (err) {
-        free(name);
-    }
-    return err;
-}
-
-int template_pipeline_noop(stream* in, state* state, size_t* depth, bool eval_define) {
-    unsigned char cp[4];
-    size_t cp_len;
-    int err = stream_next_utf8_cp(in, cp, &cp_len);
-    if (err) {
-        return err;
-    }
-    if (cp_len != 1) {
-        return ERR_TEMPLATE_INVALID_SYNTAX;
-    }
-    if (cp[0] != '-') {
-        err = stream_seek(in, -1);
+        err = stream_next_utf8_cp(in, cp, &cp_len);
         if (err) {
             return err;
         }
-    }
-    size_t ident_count = 0;
-    while (true) {
-        err = template_next_nonspace(in, cp, &cp_len);
+        if (cp_len != 1 || cp[0] != '/') {
+            continue;
+        }
+        err = stream_next_utf8_cp(in, cp, &cp_len);
         if (err) {
             return err;
         }
         if (cp_len != 1) {
             return ERR_TEMPLATE_INVALID_SYNTAX;
         }
-        char leading = (char)cp[0];
-        char* str;
-        switch (leading) {
-            case '"':
-                err = template_parse_regular_str(in, &str);
-                if (err) {
-                    return 0;
-                }
-                free(str);
-                break;
-            case '`':
-                err = template_parse_backtick_str(in, &str);
-                if (err) {
-                    return 0;
-                }
-                free(str);
-                break;
-            case '-':
-                err = stream_next_utf8_cp(in, cp, &cp_len);
-                if (err) {
-                    return err;
-                }
-                if (cp_len != 1 || cp[0] != '}') {
-                    return ERR_TEMPLATE_INVALID_SYNTAX;
-                }
-                // deliberate fallthrough
+        switch (cp[0]) {
             case '}':
+                return stream_seek(in, -cp_len);
+            case ' ':
                 err = stream_next_utf8_cp(in, cp, &cp_len);
                 if (err) {
                     return err;
                 }
-                if (cp_len != 1 || cp[0] != '}') {
+                if (cp_len != 1 || cp[0] != '-') {
                     return ERR_TEMPLATE_INVALID_SYNTAX;
                 }
-                return 0;
+                return stream_seek(in, -cp_len);
             default:
-                err = template_parse_noop_ident(in, state, leading);
-                if (err) {
-                    return err;
-                }
-                if (strcmp("if", state->ident) == 0 || strcmp("range", state->ident) == 0 || strcmp("with", state->ident) == 0) {
-                    if (ident_count > 0) {
-                        return ERR_TEMPLATE_INVALID_SYNTAX;
-                    }
-                    (*depth)++;
-                } else if (strcmp("block", state->ident) == 0) {
-                    err = template_pipeline_noop_register_block(in, state);
-                    if (err) {
-                        return err;
-                    }
-                    if (ident_count > 0) {
-                        return ERR_TEMPLATE_INVALID_SYNTAX;
-                    }
-                    (*depth)++;
-                } else if (strcmp("define", state->ident) == 0) {
-                    if (eval_define) {
-                        return ERR_TEMPLATE_DEFINE_NESTED;
-                    }
-                    if (ident_count > 0) {
-                        return ERR_TEMPLATE_INVALID_SYNTAX;
-                    }
-                    (*depth)++;
-                } else if (strcmp("end", state->ident) == 0) {
-                    if (ident_count > 0) {
-                        return ERR_TEMPLATE_INVALID_SYNTAX;
-                    }
-                    if (*depth == 0) {
-                        state->return_reason = RETURN_REASON_END;
-                        return 0;
-                    }
-                    (*depth)--;
-                } else if (strcmp("else", state->ident) == 0) {
-                    if (ident_count > 0) {
-                        return ERR_TEMPLATE_INVALID_SYNTAX;
-                    }
-                    if (*depth == 0) {
-                        state->return_reason = RETURN_REASON_ELSE;
-                        return 0;
-                    }
-                }
-                break;
+                return ERR_TEMPLATE_INVALID_SYNTAX;
         }
-        ident_count++;
     }
 }
 
-int template_run_noop(stream* in, state* state, bool eval_define) {
-    unsigned char cp[4];
-    size_t cp_len;
-    size_t depth = 0;
-    int err = 0;
-    while (true) {
-        err = stream_next_utf8_cp(in, cp, &cp_len);
-        if (err) {
-            return err;
-        }
-        if (cp[0] != '{') {
-            continue;
-        }
-        err = stream_next_utf8_cp(in, cp, &cp_len);
-        if (err) {
-            return err;
-        }
-        if (cp[0] != '{') {
-            continue;
-        }
-        err = template_pipeline_noop(in, state, &depth, eval_define);
-        if (err) {
-            return err;
-        }
-        if (state->return_reason == RETURN_REASON_END || state->return_reason == RETURN_REASON_ELSE) {
-            return 0;
-        }
+
+int template_parse_list(stream* in, parser* p, template_node** list);
+
+// parses a list, which needs to be terminated by an end or else pipeline
+int template_parse_body(stream* in, parser* p, template_node** list) {
+    int err = template_parse_list(in, p, list);
+    if (err == EOF) {
+        return ERR_TEMPLATE_UNEXPECTED_EOF;
     }
+    return err;
 }
 
-int template_run_plain(stream* in, state* state);
+// parses the list of a define or block, which may neither contain
+// further defines nor break out of an enclosing range
+int template_parse_define_body(stream* in, parser* p, template_node** list) {
+    bool in_define = p->in_define;
+    size_t range_depth = p->range_depth;
+    size_t vars_len = p->vars_len;
+    size_t vars_visible = p->vars_visible;
+    p->in_define = true;
+    p->range_depth = 0;
+    // the body cannot see any variable declared so far, but $
+    // which refers to the dot it is called with
+    p->vars_visible = vars_len;
+    parser_declare_var(p, "");
+    int err = template_parse_body(in, p, list);
+    parser_leave_scope(p, vars_len);
+    p->vars_visible = vars_visible;
+    p->in_define = in_define;
+    p->range_depth = range_depth;
+    if (err) {
+        return err;
+    }
+    if (p->return_reason != RETURN_REASON_END) {
+        return ERR_TEMPLATE_INVALID_SYNTAX;
+    }
+    p->return_reason = RETURN_REASON_REGULAR;
+    return 0;
+}
 
-int template_if(stream* in, state* state) {
-    json_value nothing = JSON_NULL;
-    bool any_branch = false;
-    while (true) {
-        stack_push_frame(&state->stack);
-        tracked_value cond = TRACKED_NULL;
-        int err = template_parse_expr(in, state, &cond, TEMPLATE_PARSE_EXPR_FORCE_SPACE);
-        if (err) {
-            tracked_value_free(&cond);
-            stack_pop_frame(&state->stack);
-            return err;
-        }
-        err = template_end_pipeline(in, state, &nothing);
-        if (err) {
-            tracked_value_free(&cond);
-            stack_pop_frame(&state->stack);
-            return err;
-        }
-        bool cond_empty = is_empty(&cond.val);
-        if (cond_empty || any_branch) {
-            err = template_run_noop(in, state, false);
-        } else {
-            any_branch = true;
-            err = template_run_plain(in, state);
-        }
-        tracked_value_free(&cond);
-        if (err) {
-            stack_pop_frame(&state->stack);
-            return err;
-        }
-        bool is_else = state->return_reason == RETURN_REASON_ELSE;
-        if (state->return_reason != RETURN_REASON_BREAK && state->return_reason != RETURN_REASON_CONTINUE) {
-            state->return_reason = RETURN_REASON_REGULAR;
-        }
-        stack_pop_frame(&state->stack);
-        if (!is_else) {  // end, break, continue
-            return 0;
-        }
-        err = template_skip_whitespace(in);
+// parses an else branch, after the "else" keyword was consumed
+int template_parse_else(stream* in, parser* p, template_node** list, const char* chain_keyword, int (*chain)(stream*, parser*, template_node**)) {
+    p->return_reason = RETURN_REASON_REGULAR;
+    int err = template_skip_whitespace(in);
+    if (err) {
+        return err;
+    }
+    err = template_parse_ident(in, p);
+    if (err) {
+        return err;
+    }
+    if (strlen(p->ident) == 0) {  // clean else pipeline
+        err = template_end_pipeline(in);
         if (err) {
             return err;
         }
-        err = template_parse_ident(in, state);
+        size_t scope = p->vars_len;
+        err = template_parse_body(in, p, list);
+        parser_leave_scope(p, scope);
         if (err) {
             return err;
         }
-        size_t ident_len = strlen(state->ident);
-        if (ident_len == 0) {  // clean else pipeline
-            break;
-        }
-        if (strcmp(state->ident, "if") != 0) {  // no else if
+        if (p->return_reason != RETURN_REASON_END) {
             return ERR_TEMPLATE_INVALID_SYNTAX;
         }
+        return 0;
+    }
+    if (strcmp(p->ident, chain_keyword) != 0) {  // no else if/with
+        return ERR_TEMPLATE_INVALID_SYNTAX;
     }
-    int err = template_end_pipeline(in, state, &nothing);
+    return chain(in, p, list);
+}
+
+int template_parse_if(stream* in, parser* p, template_node** out);
+int template_parse_with(stream* in, parser* p, template_node** out);
+
+int template_parse_branch(stream* in, parser* p, template_node** out, int ty) {
+    template_node* node = template_node_new(ty);
+    size_t scope = p->vars_len;
+    size_t var_refs = p->var_refs;
+    int err = template_parse_expr(in, p, &node->inner.branch.cond, TEMPLATE_PARSE_EXPR_FORCE_SPACE);
     if (err) {
-        return err;
+        goto cleanup;
     }
-    if (any_branch) {
-        err = template_run_noop(in, state, false);
-    } else {
-        stack_push_frame(&state->stack);
-        err = template_run_plain(in, state);
-        stack_pop_frame(&state->stack);
+    err = template_end_pipeline(in);
+    if (err) {
+        goto cleanup;
     }
+    bool refers_var = var_refs != p->var_refs;
+    size_t var_assigns = p->var_assigns;
+    err = template_parse_body(in, p, &node->inner.branch.body);
+    node->inner.branch.pin = refers_var && var_assigns != p->var_assigns;
+    parser_leave_scope(p, scope);
     if (err) {
-        return err;
+        goto cleanup;
     }
-    if (state->return_reason != RETURN_REASON_END) {
-        return ERR_TEMPLATE_INVALID_SYNTAX;
+    if (p->return_reason == RETURN_REASON_ELSE) {
+        if (ty == NODE_IF) {
+            err = template_parse_else(in, p, &node->inner.branch.else_body, "if", template_parse_if);
+        } else {
+            err = template_parse_else(in, p, &node->inner.branch.else_body, "with", template_parse_with);
+        }
+        if (err) {
+            goto cleanup;
+        }
     }
-    if (state->return_reason != RETURN_REASON_BREAK && state->return_reason != RETURN_REASON_CONTINUE) {
-        state->return_reason = RETURN_REASON_REGULAR;
+    p->return_reason = RETURN_REASON_REGULAR;
+cleanup:
+    if (err) {
+        template_node_free(node);
+        return err;
     }
+    *out = node;
     return 0;
 }
 
-typedef struct {
-    tracked_value iterable;
-    char* key_name;
-    char* value_name;
-} range_params;
-
-void range_params_free(range_params* params) {
-    tracked_value_free(&params->iterable);
-    free(params->key_name);
-    free(params->value_name);
-}
-
-// requires fresh stack frame
-int template_parse_range_params(state* state, stream* in, range_params* params) {
-    params->iterable = TRACKED_NULL;
-    params->key_name = NULL;
-    params->value_name = NULL;
+int template_parse_if(stream* in, parser* p, template_node** out) {
+    return template_parse_branch(in, p, out, NODE_IF);
+}
+
+int template_parse_with(stream* in, parser* p, template_node** out) {
+    return template_parse_branch(in, p, out, NODE_WITH);
+}
+
+int template_parse_range_params(stream* in, parser* p, template_node* node) {
     // start post range keyword
     unsigned char cp[4];
     size_t cp_len;
+    size_t slot;
     int err = stream_next_utf8_cp(in, cp, &cp_len);
     if (err) {
-        goto cleanup;
+        return err;
     }
     if (cp_len != 1) {
-        err = ERR_TEMPLATE_INVALID_SYNTAX;
-        goto cleanup;
+        return ERR_TEMPLATE_INVALID_SYNTAX;
     }
     if (cp[0] != '$' && cp[0] != '(' && !isspace(cp[0])) {
-        err = ERR_TEMPLATE_INVALID_SYNTAX;
-        goto cleanup;
+        return ERR_TEMPLATE_INVALID_SYNTAX;
     }
     if (cp[0] != '(') {
         err = template_next_nonspace(in, cp, &cp_len);
     }
     if (err) {
-        goto cleanup;
+        return err;
     }
     if (cp_len != 1) {
-        err = ERR_TEMPLATE_INVALID_SYNTAX;
-        goto cleanup;
+        return ERR_TEMPLATE_INVALID_SYNTAX;
     }
     // if not starts with $ => parse_expr
     if (cp[0] != '$') {
         err = stream_seek(in, -1);
         if (err) {
-            goto cleanup;
+            return err;
         }
-        err = template_parse_expr(in, state, &params->iterable, 0);
-        goto cleanup;
+        return template_parse_expr(in, p, &node->inner.range.iterable, 0);
     }
-    err = template_parse_ident(in, state);
+    err = template_parse_ident(in, p);
     if (err) {
-        goto cleanup;
+        return err;
     }
     err = template_next_nonspace(in, cp, &cp_len);
     if (err) {
-        goto cleanup;
+        return err;
     }
     if (cp_len != 1) {
-        err = ERR_TEMPLATE_INVALID_SYNTAX;
-        goto cleanup;
+        return ERR_TEMPLATE_INVALID_SYNTAX;
     }
-    const json_value* var;
     switch (cp[0]) {
         case ',':
             err = template_next_nonspace(in, cp, &cp_len);
             if (err) {
-                goto cleanup;
+                return err;
             }
             if (cp_len != 1 || cp[0] != '$') {
-                err = ERR_TEMPLATE_INVALID_SYNTAX;
-                goto cleanup;
+                return ERR_TEMPLATE_INVALID_SYNTAX;
             }
-            params->key_name = strdup(state->ident);
-            err = template_parse_ident(in, state);
+            node->inner.range.key_name = strdup(p->ident);
+            err = template_parse_ident(in, p);
             if (err) {
-                goto cleanup;
+                return err;
             }
             err = template_next_nonspace(in, cp, &cp_len);
             if (err) {
-                goto cleanup;
+                return err;
             }
             if (cp_len != 1 || cp[0] != ':') {
-                err = ERR_TEMPLATE_INVALID_SYNTAX;
-                goto cleanup;
+                return ERR_TEMPLATE_INVALID_SYNTAX;
             }
             // deliberate fallthrough
         case ':':
             err = stream_next_utf8_cp(in, cp, &cp_len);
             if (err) {
-                goto cleanup;
+                return err;
             }
             if (cp_len != 1 || cp[0] != '=') {
-                err = ERR_TEMPLATE_INVALID_SYNTAX;
-                goto cleanup;
+                return ERR_TEMPLATE_INVALID_SYNTAX;
             }
-            params->value_name = strdup(state->ident);
-            err = template_parse_expr(in, state, &params->iterable, 0);
-            goto cleanup;
+            node->inner.range.value_name = strdup(p->ident);
+            return template_parse_expr(in, p, &node->inner.range.iterable, 0);
         case '-':
         case '}':
-            var = stack_find_var(&state->stack, state->ident);
-            if (var == NULL) {
-                err = ERR_TEMPLATE_VAR_UNKNOWN;
-                goto cleanup;
+            if (!parser_find_var(p, p->ident, &slot)) {
+                return ERR_TEMPLATE_VAR_UNKNOWN;
             }
-            params->iterable.is_heap = false;
-            params->iterable.val = *var;
-            err = stream_seek(in, -1);
-            goto cleanup;
+            p->var_refs++;
+            node->inner.range.iterable = template_expr_new(EXPR_VAR);
+            node->inner.range.iterable->inner.var = slot;
+            return stream_seek(in, -1);
         default:
-            err = ERR_TEMPLATE_INVALID_SYNTAX;
-            goto cleanup;
-    }
-cleanup:
-    if (err) {
-        range_params_free(params);
-        params->key_name = NULL;
-        params->value_name = NULL;
-        params->iterable = TRACKED_NULL;
-    }
-    return err;
-}
-
-typedef struct {
-    int ty;
-    size_t count;
-    size_t len;
-    char** keys;
-    union {
-        const json_array* arr;
-        const hashmap* obj;
-    } inner;
-} value_iter;
-
-int compare_str(const void* a, const void* b) {
-    return strcmp(*((char**)a), *((char**)b));
-}
-
-#ifdef FUZZING_BUILD_MODE
-#define RANGE_INT_MAX 8
-#else
-#define RANGE_INT_MAX SIZE_MAX
-#endif
-
-int value_iter_new(value_iter* iter, json_value* val) {
-    switch (val->ty) {
-        case JSON_TY_NUMBER:
-            iter->ty = JSON_TY_NUMBER;
-            iter->count = 0;
-            double num = val->inner.num;
-            // not using validate_index from func.c, because
-            // it is valid to iterate over negative integers
-            if (trunc(num) != num) {
-                return ERR_TEMPLATE_NO_ITERABLE;
-            }
-            if (num > 0.0) {
-                if (num > (double)RANGE_INT_MAX) {
-                    return ERR_TEMPLATE_NO_ITERABLE;
-                }
-                iter->len = num;
-            } else {
-                iter->len = 0;
-            }
-            iter->keys = NULL;
-            return 0;
-        case JSON_TY_ARRAY:
-            iter->ty = JSON_TY_ARRAY;
-            iter->count = 0;
-            iter->len = val->inner.arr.len;
-            iter->inner.arr = &val->inner.arr;
-            iter->keys = NULL;
-            return 0;
-        case JSON_TY_OBJECT:
-            iter->ty = JSON_TY_OBJECT;
-            iter->count = 0;
-            iter->len = val->inner.obj.count;
-            iter->inner.obj = &val->inner.obj;
-            iter->keys = (char**)hashmap_keys(&val->inner.obj);
-            qsort(iter->keys, iter->len, sizeof(char*), compare_str);
-            return 0;
-    }
-    return ERR_TEMPLATE_NO_ITERABLE;
-}
-
-void value_iter_free(value_iter* iter) {
-    if (iter->ty == JSON_TY_OBJECT) {
-        free(iter->keys);
-    }
-}
-
-typedef struct {
-    size_t idx;
-    json_value key;
-    json_value val;
-} value_iter_out;
-
-bool value_iter_next(value_iter* iter, value_iter_out* out) {
-    if (iter->count >= iter->len) {
-        return false;
-    }
-    switch (iter->ty) {
-        case JSON_TY_NUMBER:
-            out->idx = iter->count;
-            out->key.ty = JSON_TY_NUMBER;
-            out->key.inner.num = iter->count;
-            out->val.ty = JSON_TY_NUMBER;
-            out->val.inner.num = iter->count;
-            iter->count++;
-            return true;
-        case JSON_TY_ARRAY:
-            out->idx = iter->count;
-            out->key.ty = JSON_TY_NUMBER;
-            out->key.inner.num = iter->count;
-            out->val = iter->inner.arr->data[iter->count];
-            iter->count++;
-            return true;
-        case JSON_TY_OBJECT:
-            out->idx = iter->count;
-            out->key.ty = JSON_TY_STRING;
-            char* key = iter->keys[iter->count];
-            out->key.inner.str = key;
-            json_value* val;
-            int found = hashmap_get(iter->inner.obj, key, (const void**)&val);
-            assert(found);
-            out->val = *val;
-            iter->count++;
-            return true;
+            return ERR_TEMPLATE_INVALID_SYNTAX;
     }
-    assert(0);
-    return false;
 }
 
-int template_range(stream* in, state* state) {
-    json_value nothing = JSON_NULL;
-    stack_push_frame(&state->stack);  // holds arg if var def
-    range_params params;
-    value_iter iter = {.ty = JSON_TY_NULL};  // value_iter_free depends on initalized ty
-    int err = template_parse_range_params(state, in, &params);
-    if (err) {
-        goto clean_pop1;
-    }
-    switch (params.iterable.val.ty) {
-        case JSON_TY_NUMBER:
-            if (params.key_name != NULL) {
-                err = ERR_TEMPLATE_NO_ITERABLE;
-                goto clean_pop1;
-            }
-            break;
-        case JSON_TY_ARRAY:
-        case JSON_TY_OBJECT:
-            break;
-        default:
-            err = ERR_TEMPLATE_NO_ITERABLE;
-            goto clean_pop1;
-    }
-    if (is_empty(&params.iterable.val)) {
-        err = template_end_pipeline(in, state, &nothing);
-        if (err) {
-            goto clean_pop1;
-        }
-        err = template_run_noop(in, state, false);
-        if (err) {
-            goto clean_pop1;
-        }
-        bool is_else = state->return_reason == RETURN_REASON_ELSE;
-        state->return_reason = RETURN_REASON_REGULAR;
-        if (!is_else) {
-            goto clean_pop1;
-        }
-        err = template_end_pipeline(in, state, &nothing);
-        if (err) {
-            goto clean_pop1;
-        }
-        err = template_run_plain(in, state);
-        if (err) {
-            goto clean_pop1;
-        }
-        state->return_reason = RETURN_REASON_REGULAR;
-        goto clean_pop1;
-    }
-
-    json_value* current = state->dot;
-    long pre_pos;
-    err = stream_pos(in, &pre_pos);
-    if (err) {
-        goto clean_pop1;
-    }
-    err = value_iter_new(&iter, &params.iterable.val);
-    if (err) {
-        goto clean_pop1;
-    }
-    value_iter_out out;
-    while (value_iter_next(&iter, &out)) {
-        err = template_end_pipeline(in, state, &nothing);
-        if (err) {
-            goto clean_pop1;
-        }
-        // post range pipeline
-        state->dot = &out.val;
-        stack_push_frame(&state->stack);
-        if (params.key_name != NULL) {
-            err = stack_set_ref(&state->stack, params.key_name, &out.key);
-            if (err) {
-                goto clean_pop2;
-            }
-        }
-        if (params.value_name != NULL) {
-            err = stack_set_ref(&state->stack, params.value_name, &out.val);
-            if (err) {
-                goto clean_pop2;
-            }
-        }
-        err = template_run_plain(in, state);
-        stack_pop_frame(&state->stack);
-        if (err) {
-            goto clean_pop1;
-        }
-        err = stream_set_pos(in, pre_pos);
-        if (err) {
-            goto clean_pop1;
-        }
-        if (state->return_reason == RETURN_REASON_BREAK) {
-            break;
-        }
-        state->return_reason = RETURN_REASON_REGULAR;
-    }
-    stack_pop_frame(&state->stack);
-    // find the terminating end/else pipeline.
-    // each iteration of the iteration loop could
-    // be terminated early by a break/continue statement.
-    err = template_end_pipeline(in, state, &nothing);
+int template_parse_range(stream* in, parser* p, template_node** out) {
+    template_node* node = template_node_new(NODE_RANGE);
+    size_t scope = p->vars_len;
+    size_t var_refs = p->var_refs;
+    int err = template_parse_range_params(in, p, node);
     if (err) {
         goto cleanup;
     }
-    err = template_run_noop(in, state, false);
+    err = template_end_pipeline(in);
     if (err) {
         goto cleanup;
     }
-    bool is_else = state->return_reason == RETURN_REASON_ELSE;
-    state->return_reason = RETURN_REASON_REGULAR;
-    state->dot = current;
-    if (!is_else) {
-        goto cleanup;
+    bool refers_var = var_refs != p->var_refs;
+    size_t params_scope = p->vars_len;
+    if (node->inner.range.key_name != NULL) {
+        node->inner.range.key_slot = parser_declare_var(p, node->inner.range.key_name);
     }
-    err = template_end_pipeline(in, state, &nothing);
-    if (err) {
-        goto cleanup;
+    if (node->inner.range.value_name != NULL) {
+        node->inner.range.value_slot = parser_declare_var(p, node->inner.range.value_name);
     }
-    err = template_run_noop(in, state, false);
+    size_t var_assigns = p->var_assigns;
+    p->range_depth++;
+    err = template_parse_body(in, p, &node->inner.range.body);
+    p->range_depth--;
+    node->inner.range.pin = refers_var && var_assigns != p->var_assigns;
+    parser_leave_scope(p, params_scope);
     if (err) {
         goto cleanup;
     }
-    if (state->return_reason != RETURN_REASON_END) {
-        err = ERR_TEMPLATE_INVALID_SYNTAX;
-        goto cleanup;
-    }
-    state->return_reason = RETURN_REASON_REGULAR;
-    goto cleanup;
-
-clean_pop2:
-    stack_pop_frame(&state->stack);
-clean_pop1:
-    stack_pop_frame(&state->stack);
-cleanup:
-    value_iter_free(&iter);
-    range_params_free(&params);
-    return err;
-}
-
-int template_with(stream* in, state* state) {
-    json_value nothing = JSON_NULL;
-    bool any_branch = false;
-    while (true) {
-        stack_push_frame(&state->stack);
-        tracked_value arg = TRACKED_NULL;
-        int err = template_parse_expr(in, state, &arg, TEMPLATE_PARSE_EXPR_FORCE_SPACE);
-        if (err == ERR_TEMPLATE_KEY_UNKNOWN) {
-            arg = TRACKED_NULL;
-            err = 0;
-        }
-        if (err) {
-            tracked_value_free(&arg);
-            stack_pop_frame(&state->stack);
-            return err;
-        }
-        err = template_end_pipeline(in, state, &nothing);
-        if (err) {
-            tracked_value_free(&arg);
-            stack_pop_frame(&state->stack);
-            return err;
-        }
-        bool arg_empty = is_empty(&arg.val);
-        if (arg_empty) {
-            err = template_run_noop(in, state, false);
-        } else {
-            // Add another stack frame in case arg originates from the stack
-            // but is reassigned in the body causing a double-free, e.g.
-            // "{{ with $ = . }}{{ $ = "a" }}{{ . }}".
-            // The second assignment would free arg once
-            stack_push_frame(&state->stack);
-            any_branch = true;
-            json_value* previous = state->dot;
-            state->dot = &arg.val;
-            err = template_run_plain(in, state);
-            state->dot = previous;
-            stack_pop_frame(&state->stack);
-        }
-        tracked_value_free(&arg);
-        if (err) {
-            stack_pop_frame(&state->stack);
-            return err;
-        }
-        bool is_else = state->return_reason == RETURN_REASON_ELSE;
-        if (state->return_reason != RETURN_REASON_BREAK && state->return_reason != RETURN_REASON_CONTINUE) {
-            state->return_reason = RETURN_REASON_REGULAR;
-        }
-        stack_pop_frame(&state->stack);
-        if (!is_else) {  // end, break, continue
-            return 0;
-        }
-        err = template_skip_whitespace(in);
+    if (p->return_reason == RETURN_REASON_ELSE) {
+        p->return_reason = RETURN_REASON_REGULAR;
+        err = template_end_pipeline(in);
         if (err) {
-            return err;
+            goto cleanup;
         }
-        err = template_parse_ident(in, state);
+        err = template_parse_body(in, p, &node->inner.range.else_body);
         if (err) {
-            return err;
-        }
-        size_t ident_len = strlen(state->ident);
-        if (ident_len == 0) {  // clean else pipeline
-            break;
+            goto cleanup;
         }
-        if (strcmp(state->ident, "with") != 0) {  // no else with
-            return ERR_TEMPLATE_INVALID_SYNTAX;
+        if (p->return_reason != RETURN_REASON_END) {
+            err = ERR_TEMPLATE_INVALID_SYNTAX;
+            goto cleanup;
         }
     }
-    int err = template_end_pipeline(in, state, &nothing);
-    if (err) {
-        return err;
-    }
-    if (any_branch) {
-        err = template_run_noop(in, state, false);
-    } else {
-        stack_push_frame(&state->stack);
-        err = template_run_plain(in, state);
-        stack_pop_frame(&state->stack);
-    }
+    p->return_reason = RETURN_REASON_REGULAR;
+cleanup:
+    parser_leave_scope(p, scope);
     if (err) {
+        template_node_free(node);
         return err;
     }
-    if (state->return_reason != RETURN_REASON_END) {
-        return ERR_TEMPLATE_INVALID_SYNTAX;
-    }
-    if (state->return_reason != RETURN_REASON_BREAK && state->return_reason != RETURN_REASON_CONTINUE) {
-        state->return_reason = RETURN_REASON_REGULAR;
-    }
+    *out = node;
     return 0;
 }
 
-int template_define(stream* in, state* state) {
-    if (state->eval_block) {
+void template_register_define(parser* p, char* name, template_node* list) {
+    entry previous = hashmap_insert(p->defines, name, list);
+    if (previous.exists) {
+        free(previous.key);
+        template_node_free(previous.value);
+    }
+}
+
+int template_parse_define(stream* in, parser* p) {
+    if (p->in_define) {
         return ERR_TEMPLATE_DEFINE_NESTED;
     }
     char* name;
@@ -1795,63 +1485,28 @@ int template_define(stream* in, state* state) {
     if (err) {
         return err;
     }
-    json_value nothing = JSON_NULL;
-    err = template_end_pipeline(in, state, &nothing);
+    template_node* list = NULL;
+    err = template_end_pipeline(in);
     if (err) {
         goto cleanup;
     }
-    long pos;
-    err = stream_pos(in, &pos);
+    err = template_parse_define_body(in, p, &list);
     if (err) {
         goto cleanup;
     }
-    err = template_run_noop(in, state, true);
-    if (err) {
-        goto cleanup;
-    }
-    if (state->return_reason != RETURN_REASON_END) {
-        err = ERR_TEMPLATE_INVALID_SYNTAX;
-        goto cleanup;
-    }
-    state->return_reason = RETURN_REASON_REGULAR;
-    assert(sizeof(long) == sizeof(void*));
-    entry previous = hashmap_insert(&state->define_locs, name, (void*)pos);
-    if (previous.exists) {
-        free(previous.key);
-    }
+    template_register_define(p, name, list);
 cleanup:
     if (err) {
         free(name);
+        template_node_free(list);
     }
     return err;
 }
 
-int template_run_nested(stream* in, state* state, json_value* new_dot) {
-    json_value* current_dot = state->dot;
-    state->dot = new_dot;
-    stack current_stack = state->stack;
-    stack_new(&state->stack);
-    stack_push_frame(&state->stack);
-    stack_push_frame(&state->stack);
-    int err = template_run_plain(in, state);
-    stack_pop_frame(&state->stack);
-    stack_pop_frame(&state->stack);
-    stack_free(&state->stack);
-    state->stack = current_stack;
-    state->dot = current_dot;
-    return err;
-}
-
-int template_template(stream* in, state* state) {
-    char* name;
-    int err = template_parse_define_name(in, &name);
+int template_parse_template(stream* in, parser* p, template_node** out) {
+    template_node* node = template_node_new(NODE_TEMPLATE);
+    int err = template_parse_define_name(in, &node->inner.call.name);
     if (err) {
-        return err;
-    }
-    long define_pos;
-    int found = hashmap_get(&state->define_locs, name, (const void**)&define_pos);
-    if (!found) {
-        err = ERR_TEMPLATE_DEFINE_UNKNOWN;
         goto cleanup;
     }
     unsigned char cp[4];
@@ -1864,57 +1519,25 @@ int template_template(stream* in, state* state) {
         err = ERR_TEMPLATE_INVALID_SYNTAX;
         goto cleanup;
     }
-    tracked_value arg = TRACKED_NULL;
-    err = template_parse_expr(in, state, &arg, 0);
-    switch (err) {
-        case 0:
-            break;
-        case ERR_TEMPLATE_NO_VALUE:
-            tracked_value_free(&arg);
-            arg = TRACKED_NULL;
-            break;
-        default:
-            tracked_value_free(&arg);
-            goto cleanup;
-    }
-    long current_pos;
-    err = stream_pos(in, &current_pos);
-    if (err) {
-        tracked_value_free(&arg);
-        goto cleanup;
-    }
-    err = stream_set_pos(in, define_pos);
-    if (err) {
-        tracked_value_free(&arg);
-        goto cleanup;
-    }
-    err = template_run_nested(in, state, &arg.val);
-    if (err) {
-        tracked_value_free(&arg);
-        goto cleanup;
-    }
-    if (state->return_reason != RETURN_REASON_END) {
-        err = ERR_TEMPLATE_INVALID_SYNTAX;
-        tracked_value_free(&arg);
-        goto cleanup;
+    err = template_parse_expr(in, p, &node->inner.call.arg, 0);
+    if (err == ERR_TEMPLATE_NO_VALUE) {
+        err = 0;
     }
-    state->return_reason = RETURN_REASON_REGULAR;
-    err = stream_set_pos(in, current_pos);
+cleanup:
     if (err) {
-        tracked_value_free(&arg);
-        goto cleanup;
+        template_node_free(node);
+        return err;
     }
-    tracked_value_free(&arg);
-cleanup:
-    free(name);
-    return err;
+    *out = node;
+    return 0;
 }
 
-int template_block(stream* in, state* state) {
-    char* name;
-    int err = template_parse_define_name(in, &name);
+int template_parse_block(stream* in, parser* p, template_node** out) {
+    template_node* node = template_node_new(NODE_TEMPLATE);
+    template_node* list = NULL;
+    int err = template_parse_define_name(in, &node->inner.call.name);
     if (err) {
-        return err;
+        goto cleanup;
     }
     unsigned char cp[4];
     size_t cp_len;
@@ -1926,317 +1549,86 @@ int template_block(stream* in, state* state) {
         err = ERR_TEMPLATE_INVALID_SYNTAX;
         goto cleanup;
     }
-    tracked_value arg = TRACKED_NULL;
-    err = template_parse_expr(in, state, &arg, 0);
-    if (err) {
-        tracked_value_free(&arg);
-        goto cleanup;
-    }
-    json_value nothing = JSON_NULL;
-    err = template_end_pipeline(in, state, &nothing);
+    err = template_parse_expr(in, p, &node->inner.call.arg, 0);
     if (err) {
-        tracked_value_free(&arg);
         goto cleanup;
     }
-    long pos;
-    err = stream_pos(in, &pos);
+    err = template_end_pipeline(in);
     if (err) {
-        tracked_value_free(&arg);
         goto cleanup;
     }
-    state->eval_block = true;
-    err = template_run_nested(in, state, &arg.val);
-    state->eval_block = false;
+    err = template_parse_define_body(in, p, &list);
     if (err) {
-        tracked_value_free(&arg);
         goto cleanup;
     }
-    if (state->return_reason != RETURN_REASON_END) {
-        err = ERR_TEMPLATE_INVALID_SYNTAX;
-        tracked_value_free(&arg);
-        goto cleanup;
-    }
-    state->return_reason = RETURN_REASON_REGULAR;
-    assert(sizeof(long) == sizeof(void*));
-    entry previous = hashmap_insert(&state->define_locs, name, (void*)pos);
-    if (previous.exists) {
-        free(previous.key);
-    }
-    tracked_value_free(&arg);
+    template_register_define(p, strdup(node->inner.call.name), list);
 cleanup:
     if (err) {
-        free(name);
+        template_node_free(list);
+        template_node_free(node);
+        return err;
     }
-    return err;
+    *out = node;
+    return 0;
 }
 
-#ifdef FUZZING_BUILD_MODE
-#define RANGE_DEPTH_MAX 3
-#else
-#define RANGE_DEPTH_MAX 24
-#endif
-
-int template_dispatch_keyword(stream* in, state* state) {
-    int err = template_parse_ident(in, state);
+int template_parse_keyword(stream* in, parser* p, template_node** out) {
+    int err = template_parse_ident(in, p);
     if (err) {
         return err;
     }
-    if (strcmp("if", state->ident) == 0) {
-        err = template_if(in, state);
-        if (err == EOF) {
-            return ERR_TEMPLATE_UNEXPECTED_EOF;
-        }
-        return err;
-    }
-    if (strcmp("range", state->ident) == 0) {
-        if (state->range_depth > RANGE_DEPTH_MAX) {
-            return ERR_BUF_OVERFLOW;
-        }
-        state->range_depth++;
-        err = template_range(in, state);
-        state->range_depth--;
-        if (err == EOF) {
-            return ERR_TEMPLATE_UNEXPECTED_EOF;
-        }
-        return err;
-    }
-    if (strcmp("with", state->ident) == 0) {
-        err = template_with(in, state);
-        if (err == EOF) {
-            return ERR_TEMPLATE_UNEXPECTED_EOF;
-        }
-        return err;
-    }
-    if (strcmp("define", state->ident) == 0) {
-        err = template_define(in, state);
-        if (err == EOF) {
-            return ERR_TEMPLATE_UNEXPECTED_EOF;
-        }
-        return err;
+    if (strcmp("if", p->ident) == 0) {
+        return template_parse_if(in, p, out);
     }
-    if (strcmp("template", state->ident) == 0) {
-        err = template_template(in, state);
-        if (err == EOF) {
-            return ERR_TEMPLATE_UNEXPECTED_EOF;
-        }
-        return err;
+    if (strcmp("range", p->ident) == 0) {
+        return template_parse_range(in, p, out);
     }
-    if (strcmp("block", state->ident) == 0) {
-        err = template_block(in, state);
-        if (err == EOF) {
-            return ERR_TEMPLATE_UNEXPECTED_EOF;
-        }
-        return err;
+    if (strcmp("with", p->ident) == 0) {
+        return template_parse_with(in, p, out);
     }
-    if (strcmp("end", state->ident) == 0) {
-        // only used in the non-noop case
-        // in the noop case template_run_noop
-        // takes care of the matching "end"
-        state->return_reason = RETURN_REASON_END;
-        return 0;
+    if (strcmp("define", p->ident) == 0) {
+        return template_parse_define(in, p);
     }
-    if (strcmp("else", state->ident) == 0) {
-        // only used in the non-noop case
-        // in the noop case template_run_noop
-        // takes care of the matching "else"
-        state->return_reason = RETURN_REASON_ELSE;
-        return 0;
+    if (strcmp("template", p->ident) == 0) {
+        return template_parse_template(in, p, out);
     }
-    if (strcmp("break", state->ident) == 0) {
-        // only used in the non-noop case
-        // the noop case doesn't care about
-        // break pipelines.
-        state->return_reason = RETURN_REASON_BREAK;
-        return 0;
+    if (strcmp("block", p->ident) == 0) {
+        return template_parse_block(in, p, out);
     }
-    if (strcmp("continue", state->ident) == 0) {
-        // only used in the non-noop case
-        // the noop case doesn't care about
-        // continue pipelines.
-        state->return_reason = RETURN_REASON_CONTINUE;
+    if (strcmp("end", p->ident) == 0) {
+        p->return_reason = RETURN_REASON_END;
         return 0;
     }
-    return ERR_TEMPLATE_KEYWORD_UNKNOWN;
-}
-
-int template_eval_arg(stream* in, state* state, long where, tracked_value* result) {
-    int err = stream_set_pos(in, where);
-    if (err) {
-        return err;
-    }
-    state->eval_arg = true;
-    err = template_parse_expr(in, state, result, TEMPLATE_PARSE_EXPR_NO_PIPE | TEMPLATE_PARSE_EXPR_NO_VAR_MUT);
-    state->eval_arg = false;
-    if (err) {
-        return err;
-    }
-    // check that the next char is something template_skip_expr() would split at
-    // to ensure that the arg was fully consumed, without such a check stuff like
-    // '$#' would return '$' due to the '#' never being read and hence not producing
-    // an ERR_TEMPLATE_INVALID_SYNTAX.
-    unsigned char cp[4];
-    size_t cp_len;
-    // no need to seek back as template_dispatch_func does that
-    err = stream_next_utf8_cp(in, cp, &cp_len);
-    if (err) {
-        return err;
-    }
-    if (cp_len != 1) {
-        return ERR_TEMPLATE_INVALID_SYNTAX;
-    }
-    if (isspace(cp[0]) || cp[0] == ')' || cp[0] == '}' || cp[0] == '|') {
+    if (strcmp("else", p->ident) == 0) {
+        p->return_reason = RETURN_REASON_ELSE;
         return 0;
     }
-    return ERR_TEMPLATE_INVALID_SYNTAX;
-}
-
-int template_arg_iter_next(template_arg_iter* iter, tracked_value* result) {
-    if (iter->idx < iter->args_len) {
-        int err = template_eval_arg(iter->in, (state*)iter->state, iter->args[iter->idx], result);
-        iter->idx++;
-        if (err) {
-            tracked_value_free(result);
-            return err;
+    if (strcmp("break", p->ident) == 0) {
+        if (p->range_depth == 0) {
+            return ERR_TEMPLATE_KEYWORD_UNEXPECTED;
         }
+        *out = template_node_new(NODE_BREAK);
         return 0;
     }
-    if (iter->idx == iter->args_len && iter->piped != NULL) {
-        *result = *iter->piped;
-        iter->idx++;
-        return 0;
-    }
-    return 0;
-}
-
-int template_arg_iter_len(template_arg_iter* iter) {
-    return iter->args_len + (iter->piped ? 1 : 0);
-}
-
-#define TEMPLATE_FUNC_ARGS_MAX 16
-
-int template_dispatch_func(stream* in, state* state, tracked_value* piped, tracked_value* result) {
-    long args[TEMPLATE_FUNC_ARGS_MAX];
-    template_arg_iter iter = {
-        .in = in,
-        .args = args,
-        .idx = 0,
-        .args_len = 0,
-        .piped = piped,
-        .state = state,
-    };
-    int err = template_parse_ident(in, state);
-    if (err) {
-        goto cleanup;
-    }
-    char func_name[STATE_IDENT_CAP];
-    strcpy(func_name, state->ident);
-    long pre_end;
-    err = stream_pos(in, &pre_end);
-    if (err) {
-        goto cleanup;
-    }
-    unsigned char cp[4];
-    size_t cp_len;
-    // when evaluating a function directly passed as an argument
-    // to another function it is always evaluated with zero args
-    if (!state->eval_arg) {
-        while (true) {
-            err = stream_next_utf8_cp(in, cp, &cp_len);
-            if (err) {
-                goto cleanup;
-            }
-            if (cp_len != 1) {
-                err = ERR_TEMPLATE_INVALID_SYNTAX;
-                goto cleanup;
-            }
-            if (!(isspace(cp[0]) || cp[0] == ')' || cp[0] == '}' || cp[0] == '|')) {
-                err = ERR_TEMPLATE_INVALID_SYNTAX;
-                goto cleanup;
-            }
-            err = stream_seek(in, -cp_len);
-            if (err) {
-                goto cleanup;
-            }
-            if (iter.args_len == TEMPLATE_FUNC_ARGS_MAX) {
-                err = ERR_BUF_OVERFLOW;
-                goto cleanup;
-            }
-            err = template_skip_expr(in, args + iter.args_len);
-            if (err == ERR_TEMPLATE_NO_VALUE) {
-                pre_end = args[iter.args_len];
-                break;
-            }
-            if (err) {
-                goto cleanup;
-            }
-            iter.args_len++;
+    if (strcmp("continue", p->ident) == 0) {
+        if (p->range_depth == 0) {
+            return ERR_TEMPLATE_KEYWORD_UNEXPECTED;
         }
+        *out = template_node_new(NODE_CONTINUE);
+        return 0;
     }
-
-    funcptr f;
-    int found = hashmap_get(&state->funcmap, func_name, (const void**)&f);
-    if (!found) {
-        err = ERR_TEMPLATE_FUNC_UNKNOWN;
-        goto cleanup;
-    }
-    err = f(&iter, result);
-    if (err) {
-        goto cleanup;
-    }
-    err = stream_set_pos(in, pre_end);
-cleanup:
-    // func impls shall free every tracked_value requested
-    // from the iter, hence check where the iter is at.
-    if (piped != NULL && iter.idx < iter.args_len + 1) {
-        tracked_value_free(piped);
-    }
-    return err;
+    return ERR_TEMPLATE_KEYWORD_UNKNOWN;
 }
 
-int template_skip_comment(stream* in) {
-    unsigned char cp[4];
-    size_t cp_len;
-    while (true) {
-        int err = stream_next_utf8_cp(in, cp, &cp_len);
-        if (err) {
-            return err;
-        }
-        if (cp_len != 1 || cp[0] != '*') {
-            continue;
-        }
-        err = stream_next_utf8_cp(in, cp, &cp_len);
-        if (err) {
-            return err;
-        }
-        if (cp_len != 1 || cp[0] != '/') {
-            continue;
-        }
-        err = stream_next_utf8_cp(in, cp, &cp_len);
-        if (err) {
-            return err;
-        }
-        if (cp_len != 1) {
-            return ERR_TEMPLATE_INVALID_SYNTAX;
-        }
-        switch (cp[0]) {
-            case '}':
-                return stream_seek(in, -cp_len);
-            case ' ':
-                err = stream_next_utf8_cp(in, cp, &cp_len);
-                if (err) {
-                    return err;
-                }
-                if (cp_len != 1 || cp[0] != '-') {
-                    return ERR_TEMPLATE_INVALID_SYNTAX;
-                }
-                return stream_seek(in, -cp_len);
-            default:
-                return ERR_TEMPLATE_INVALID_SYNTAX;
-        }
-    }
+template_node* template_expr_node(int ty, template_expr* expr) {
+    template_node* node = template_node_new(ty);
+    node->inner.expr = expr;
+    return node;
 }
 
-int template_dispatch_pipeline(stream* in, state* state, tracked_value* result) {
+// parses everything between "{{" or "{{- " and the closing braces
+int template_parse_pipeline(stream* in, parser* p, template_node** out) {
+    *out = NULL;
     unsigned char cp[4];
     size_t cp_len;
     int err = stream_next_utf8_cp(in, cp, &cp_len);
@@ -2265,18 +1657,21 @@ int template_dispatch_pipeline(stream* in, state* state, tracked_value* result)
             return ERR_TEMPLATE_INVALID_SYNTAX;
         }
     }
+    template_expr* expr;
     if (cp[0] == '$') {
         long pre_pos;
         err = stream_pos(in, &pre_pos);
         if (err) {
             return err;
         }
-        err = template_parse_var_mutation(in, state, result);
+        err = template_parse_var_mutation(in, p, &expr);
         if (err != ERR_TEMPLATE_NO_MUTATION) {
-            tracked_value_free(result);
+            if (err) {
+                return err;
+            }
             // top level var assignments/definitions have their result discarded
-            *result = TRACKED_NULL;
-            return err;
+            *out = template_expr_node(NODE_MUTATION, expr);
+            return 0;
         }
         err = stream_set_pos(in, pre_pos);
         if (err) {
@@ -2284,65 +1679,53 @@ int template_dispatch_pipeline(stream* in, state* state, tracked_value* result)
         }
     }
     if (cp[0] == '(') {
-        err = template_parse_parenthesis(in, state, result);
+        err = template_parse_parenthesis(in, p, &expr);
         if (err) {
             return err;
         }
-        return template_parse_pipe(in, state, result);
+        goto pipe;
     }
-    err = template_parse_value(in, state, result, cp[0]);
+    err = template_parse_value(in, p, &expr, cp[0]);
     switch (err) {
         case 0:
             // for some reason top-level nil is invalid in go templates
-            if (result->val.ty == JSON_TY_NULL) {
+            if (expr->ty == EXPR_LITERAL && expr->inner.literal.ty == JSON_TY_NULL) {
+                template_expr_free(expr);
                 return ERR_TEMPLATE_KEYWORD_UNEXPECTED;
             }
-            return template_parse_pipe(in, state, result);
-        case ERR_TEMPLATE_KEY_UNKNOWN:
-            buf_append(&state->out, NULL_STR_NO_VALUE, sizeof(NULL_STR_NO_VALUE) - 1);
-            return 0;
+            expr->no_nil = true;
+            goto pipe;
         case ERR_TEMPLATE_NO_VALUE:
             break;
         default:
             return err;
     }
-    if (isalpha(cp[0])) {
-        err = template_dispatch_keyword(in, state);
-        if (err != ERR_TEMPLATE_KEYWORD_UNKNOWN) {
-            return err;
-        }
-        err = stream_seek(in, -strlen(state->ident));
-        if (err) {
-            return err;
-        }
-        err = template_dispatch_func(in, state, NULL, result);
-        if (err) {
-            return err;
-        }
-        return template_parse_pipe(in, state, result);
-    }
-    return ERR_TEMPLATE_INVALID_SYNTAX;
-}
-
-int template_invoke_pipeline(stream* in, state* state) {
-    tracked_value result = TRACKED_NULL;
-    int err = template_dispatch_pipeline(in, state, &result);
+    if (!isalpha(cp[0])) {
+        return ERR_TEMPLATE_INVALID_SYNTAX;
+    }
+    err = template_parse_keyword(in, p, out);
+    if (err != ERR_TEMPLATE_KEYWORD_UNKNOWN) {
+        return err;
+    }
+    err = stream_seek(in, -strlen(p->ident));
     if (err) {
-        if (err == EOF) {
-            return ERR_TEMPLATE_UNEXPECTED_EOF;
-        }
-        tracked_value_free(&result);
         return err;
     }
-    if (state->return_reason != RETURN_REASON_REGULAR) {
-        return 0;
+    err = template_parse_func(in, p, NULL, true, &expr);
+    if (err) {
+        return err;
     }
-    err = template_end_pipeline(in, state, &result.val);
-    tracked_value_free(&result);
-    return err;
+pipe:
+    err = template_parse_pipe(in, p, &expr);
+    if (err) {
+        template_expr_free(expr);
+        return err;
+    }
+    *out = template_expr_node(NODE_ACTION, expr);
+    return 0;
 }
 
-int template_start_pipeline(stream* in, state* state) {
+int template_start_pipeline(stream* in, parser* p, template_node** out) {
     unsigned char cp[4];
     size_t cp_len;
     int err = stream_next_utf8_cp(in, cp, &cp_len);
@@ -2357,7 +1740,7 @@ int template_start_pipeline(stream* in, state* state) {
         if (err) {
             return err;
         }
-        return template_invoke_pipeline(in, state);  // just past "{{"
+        return template_parse_pipeline(in, p, out);  // just past "{{"
     }
     size_t off = cp_len;
     err = stream_next_utf8_cp(in, cp, &cp_len);
@@ -2372,92 +1755,820 @@ int template_start_pipeline(stream* in, state* state) {
         if (err) {
             return err;
         }
-        return template_invoke_pipeline(in, state);  // just past "{{", "-" is guaranteed after
+        return template_parse_pipeline(in, p, out);  // just past "{{", "-" is guaranteed after
+    }
+    if (p->last_text != NULL) {
+        while (p->last_text->inner.text.len > 0 && isspace((unsigned char)p->last_text->inner.text.data[p->last_text->inner.text.len - 1])) {
+            p->last_text->inner.text.len--;
+        }
     }
-    state->out.len = state->out_nospace;
-    return template_invoke_pipeline(in, state);  // past "{{- "
+    return template_parse_pipeline(in, p, out);  // past "{{- "
+}
+
+template_node* template_text_node(buf* text) {
+    if (text->len == 0) {
+        return NULL;
+    }
+    template_node* node = template_node_new(NODE_TEXT);
+    node->inner.text.len = text->len;
+    node->inner.text.data = malloc(text->len);
+    assert(node->inner.text.data);
+    memcpy(node->inner.text.data, text->data, text->len);
+    text->len = 0;
+    return node;
 }
 
-int template_run_plain(stream* in, state* state) {
+// Appends to list until in is consumed, returning EOF, or until an end/else
+// pipeline is found, which is reported via p->return_reason. On error list
+// holds everything parsed so far.
+int template_parse_list(stream* in, parser* p, template_node** list) {
     unsigned char cp[4];
     size_t cp_len;
+    template_node** tail = list;
+    template_node* node;
+    buf text;
+    buf_init(&text);
+    p->return_reason = RETURN_REASON_REGULAR;
+    const unsigned char* span;
+    size_t span_len;
     int err = 0;
     while (true) {
+        // copy the text up to the next '{' in one go, only
+        // an invalid or truncated codepoint ends it early
+        err = stream_peek(in, &span, &span_len);
+        if (err) {
+            break;
+        }
+        const unsigned char* brace = memchr(span, '{', span_len);
+        size_t n = utf8_valid_prefix(span, brace == NULL ? span_len : (size_t)(brace - span));
+        buf_append(&text, (const char*)span, n);
+        stream_advance(in, n);
         err = stream_next_utf8_cp(in, cp, &cp_len);
         if (err) {
-            return err;
+            break;
         }
         if (cp[0] != '{') {
-            buf_append(&state->out, (const char*)cp, cp_len);
-            if (!isspace(cp[0])) {
-                state->out_nospace = state->out.len;
-            }
+            buf_append(&text, (const char*)cp, cp_len);
             continue;
         }
         err = stream_next_utf8_cp(in, cp, &cp_len);
         if (err) {
-            return err;
+            buf_append(&text, "{", 1);
+            break;
         }
         if (cp[0] != '{') {
-            char brace_open = '{';
-            buf_append(&state->out, &brace_open, 1);
-            buf_append(&state->out, (const char*)cp, cp_len);
-            if (!isspace(cp[0])) {
-                state->out_nospace = state->out.len;
-            }
+            buf_append(&text, "{", 1);
+            buf_append(&text, (const char*)cp, cp_len);
             continue;
         }
-        err = template_start_pipeline(in, state);
+        p->last_text = template_text_node(&text);
+        if (p->last_text != NULL) {
+            *tail = p->last_text;
+            tail = &p->last_text->next;
+        }
+        node = NULL;
+        err = template_start_pipeline(in, p, &node);
+        if (node != NULL) {
+            *tail = node;
+            tail = &node->next;
+        }
+        if (err == EOF) {
+            err = ERR_TEMPLATE_UNEXPECTED_EOF;
+        }
+        if (err) {
+            break;
+        }
+        if (p->return_reason != RETURN_REASON_REGULAR) {
+            break;
+        }
+        err = template_end_pipeline(in);
+        if (err == EOF) {
+            err = ERR_TEMPLATE_UNEXPECTED_EOF;
+        }
+        if (err) {
+            break;
+        }
+    }
+    if (err == EOF) {
+        node = template_text_node(&text);
+        if (node != NULL) {
+            *tail = node;
+        }
+    }
+    buf_free(&text);
+    return err;
+}
+
+
+typedef struct {
+    const compiled_template* tpl;
+    json_value* dot;
+    buf out;
+    // if set, out is flushed into write once it exceeds TEMPLATE_SINK_CHUNK
+    template_write_func write;
+    void* userdata;
+    size_t range_depth;
+    stack stack;
+    int return_reason;
+} state;
+
+#define TEMPLATE_SINK_CHUNK 8192
+
+int template_flush(state* state) {
+    if (state->out.len == 0) {
+        return 0;
+    }
+    int err = state->write(state->out.data, state->out.len, state->userdata);
+    state->out.len = 0;
+    return err;
+}
+
+int template_write_text(state* state, const char* data, size_t len) {
+    if (state->write == NULL || state->out.len + len < TEMPLATE_SINK_CHUNK) {
+        buf_append(&state->out, data, len);
+        return 0;
+    }
+    // large text is passed through without copying it into out
+    int err = template_flush(state);
+    if (err) {
+        return err;
+    }
+    return state->write(data, len, state->userdata);
+}
+
+int template_exec_expr(state* state, const template_expr* expr, tracked_value* result);
+
+int template_exec_field(state* state, const template_expr* expr, tracked_value* result) {
+    json_value* current = state->dot;
+    for (size_t i = 0; i < expr->inner.field.len; i++) {
+        json_resolve(current);
+        if (current->ty != JSON_TY_OBJECT) {
+            return ERR_TEMPLATE_NO_OBJECT;
+        }
+        int found = hashmap_get_hashed(&current->inner.obj, expr->inner.field.keys[i], expr->inner.field.hashes[i], (const void**)&current);
+        if (!found) {
+            return ERR_TEMPLATE_KEY_UNKNOWN;
+        }
+    }
+    json_resolve(current);
+    result->val = *current;
+    result->is_heap = false;
+    return 0;
+}
+
+int template_exec_mutation(state* state, const template_expr* expr, tracked_value* result) {
+    int err = template_exec_expr(state, expr->inner.mutation.value, result);
+    if (err) {
+        return err;
+    }
+    // nil cannot be assigned in go
+    if (result->val.ty == JSON_TY_NULL) {
+        return ERR_TEMPLATE_KEYWORD_UNEXPECTED;
+    }
+    if (!result->is_heap) {
+        // in case of $var=$var the second $var would be returned as result, although
+        // it is freed in stack_set
+        json_value copy;
+        json_value_copy(&copy, &result->val);
+        result->val = copy;
+    }
+    result->is_heap = false;
+    stack_set(&state->stack, expr->inner.mutation.slot, result->val, true);
+    return 0;
+}
+
+// copies value if it is not heap allocated, because it may originate
+// from a variable, whose reassignment would free it prematurely
+void template_pin(tracked_value* value) {
+    if (value->is_heap) {
+        return;
+    }
+    json_value copy;
+    json_value_copy(&copy, &value->val);
+    value->val = copy;
+    value->is_heap = true;
+}
+
+int template_exec_call(state* state, const template_expr* expr, tracked_value* result) {
+    tracked_value piped = TRACKED_NULL;
+    template_arg_iter iter = {
+        .args = expr->inner.call.args,
+        .idx = 0,
+        .args_len = expr->inner.call.args_len,
+        .piped = NULL,
+        .state = state,
+    };
+    if (expr->inner.call.piped != NULL) {
+        int err = template_exec_expr(state, expr->inner.call.piped, &piped);
         if (err) {
+            tracked_value_free(&piped);
             return err;
         }
-        if (state->return_reason != RETURN_REASON_REGULAR) {
-            if (state->stack.len == 1) {
-                return ERR_TEMPLATE_KEYWORD_UNEXPECTED;
+        // a function argument may assign another value to the variable
+        // piped originates from, as in e.g. {{ $=($="a") | print ($=3) }}.
+        template_pin(&piped);
+        iter.piped = &piped;
+    }
+    int err = expr->inner.call.f(&iter, result);
+    // func impls shall free every tracked_value requested
+    // from the iter, hence check where the iter is at.
+    if (iter.piped != NULL && iter.idx < iter.args_len + 1) {
+        tracked_value_free(iter.piped);
+    }
+    return err;
+}
+
+int template_exec_expr(state* state, const template_expr* expr, tracked_value* result) {
+    const json_value* var;
+    int err = 0;
+    switch (expr->ty) {
+        case EXPR_LITERAL:
+            result->val = expr->inner.literal;
+            result->is_heap = false;
+            break;
+        case EXPR_FIELD:
+            err = template_exec_field(state, expr, result);
+            break;
+        case EXPR_VAR:
+            var = stack_get(&state->stack, expr->inner.var);
+            if (var == NULL) {
+                return ERR_TEMPLATE_VAR_UNKNOWN;
+            }
+            result->val = *var;
+            result->is_heap = false;
+            break;
+        case EXPR_DECLARE:
+        case EXPR_ASSIGN:
+            return template_exec_mutation(state, expr, result);
+        case EXPR_CALL:
+            return template_exec_call(state, expr, result);
+    }
+    if (err) {
+        return err;
+    }
+    // for some reason top-level nil is invalid in go templates
+    if (expr->no_nil && result->val.ty == JSON_TY_NULL) {
+        return ERR_TEMPLATE_KEYWORD_UNEXPECTED;
+    }
+    return 0;
+}
+
+int template_arg_iter_next(template_arg_iter* iter, tracked_value* result) {
+    if (iter->idx < iter->args_len) {
+        int err = template_exec_expr((state*)iter->state, iter->args[iter->idx], result);
+        iter->idx++;
+        if (err) {
+            tracked_value_free(result);
+            return err;
+        }
+        return 0;
+    }
+    if (iter->idx == iter->args_len && iter->piped != NULL) {
+        *result = *iter->piped;
+        iter->idx++;
+        return 0;
+    }
+    return 0;
+}
+
+int template_arg_iter_len(template_arg_iter* iter) {
+    return iter->args_len + (iter->piped ? 1 : 0);
+}
+
+int template_exec_list(state* state, const template_node* node);
+
+int template_exec_action(state* state, const template_expr* expr) {
+    tracked_value result = TRACKED_NULL;
+    int err = template_exec_expr(state, expr, &result);
+    if (err == ERR_TEMPLATE_KEY_UNKNOWN && expr->ty == EXPR_FIELD) {
+        buf_append(&state->out, NULL_STR_NO_VALUE, sizeof(NULL_STR_NO_VALUE) - 1);
+        return 0;
+    }
+    if (err == 0 && result.val.ty != JSON_TY_NULL) {
+        err = sprintval(&state->out, &result.val, NULL_STR_NIL);
+    }
+    tracked_value_free(&result);
+    return err;
+}
+
+int template_exec_else(state* state, const template_node* list) {
+    if (list == NULL) {
+        return 0;
+    }
+    size_t scope = state->stack.len;
+    int err = template_exec_list(state, list);
+    stack_pop(&state->stack, scope);
+    return err;
+}
+
+int template_exec_if(state* state, const template_node* node) {
+    size_t scope = state->stack.len;
+    tracked_value cond = TRACKED_NULL;
+    int err = template_exec_expr(state, node->inner.branch.cond, &cond);
+    if (err) {
+        tracked_value_free(&cond);
+        stack_pop(&state->stack, scope);
+        return err;
+    }
+    bool cond_empty = is_empty(&cond.val);
+    if (!cond_empty) {
+        err = template_exec_list(state, node->inner.branch.body);
+    }
+    tracked_value_free(&cond);
+    stack_pop(&state->stack, scope);
+    if (err || !cond_empty) {
+        return err;
+    }
+    return template_exec_else(state, node->inner.branch.else_body);
+}
+
+int template_exec_with(state* state, const template_node* node) {
+    size_t scope = state->stack.len;
+    tracked_value arg = TRACKED_NULL;
+    int err = template_exec_expr(state, node->inner.branch.cond, &arg);
+    if (err == ERR_TEMPLATE_KEY_UNKNOWN) {
+        tracked_value_free(&arg);
+        arg = TRACKED_NULL;
+        err = 0;
+    }
+    if (err) {
+        tracked_value_free(&arg);
+        stack_pop(&state->stack, scope);
+        return err;
+    }
+    bool arg_empty = is_empty(&arg.val);
+    if (!arg_empty) {
+        // e.g. "{{ with $ = . }}{{ $ = "a" }}{{ . }}" would free dot
+        if (node->inner.branch.pin) {
+            template_pin(&arg);
+        }
+        json_value* previous = state->dot;
+        state->dot = &arg.val;
+        err = template_exec_list(state, node->inner.branch.body);
+        state->dot = previous;
+    }
+    tracked_value_free(&arg);
+    stack_pop(&state->stack, scope);
+    if (err || !arg_empty) {
+        return err;
+    }
+    return template_exec_else(state, node->inner.branch.else_body);
+}
+
+typedef struct {
+    int ty;
+    size_t count;
+    size_t len;
+    union {
+        const json_array* arr;
+        // ordered by key
+        const hashmap* obj;
+    } inner;
+} value_iter;
+
+#ifdef FUZZING_BUILD_MODE
+#define RANGE_INT_MAX 8
+#else
+#define RANGE_INT_MAX SIZE_MAX
+#endif
+
+int value_iter_new(value_iter* iter, json_value* val) {
+    switch (val->ty) {
+        case JSON_TY_NUMBER:
+            iter->ty = JSON_TY_NUMBER;
+            iter->count = 0;
+            double num = val->inner.num;
+            // not using validate_index from func.c, because
+            // it is valid to iterate over negative integers
+            if (trunc(num) != num) {
+                return ERR_TEMPLATE_NO_ITERABLE;
+            }
+            if (num > 0.0) {
+                if (num > (double)RANGE_INT_MAX) {
+                    return ERR_TEMPLATE_NO_ITERABLE;
+                }
+                iter->len = num;
             } else {
-                state->out_nospace = state->out.len;
+                iter->len = 0;
             }
             return 0;
-        }
-        state->out_nospace = state->out.len;
+        case JSON_TY_ARRAY:
+            iter->ty = JSON_TY_ARRAY;
+            iter->count = 0;
+            iter->len = val->inner.arr.len;
+            iter->inner.arr = &val->inner.arr;
+            return 0;
+        case JSON_TY_OBJECT:
+            iter->ty = JSON_TY_OBJECT;
+            iter->count = 0;
+            iter->len = val->inner.obj.count;
+            hashmap_order(&val->inner.obj);
+            iter->inner.obj = &val->inner.obj;
+            return 0;
     }
+    return ERR_TEMPLATE_NO_ITERABLE;
 }
 
-void define_loc_free(entry* e, void* userdata) {
-    free(e->key);
+typedef struct {
+    size_t idx;
+    json_value key;
+    json_value val;
+} value_iter_out;
+
+bool value_iter_next(value_iter* iter, value_iter_out* out) {
+    if (iter->count >= iter->len) {
+        return false;
+    }
+    switch (iter->ty) {
+        case JSON_TY_NUMBER:
+            out->idx = iter->count;
+            out->key.ty = JSON_TY_NUMBER;
+            out->key.inner.num = iter->count;
+            out->val.ty = JSON_TY_NUMBER;
+            out->val.inner.num = iter->count;
+            iter->count++;
+            return true;
+        case JSON_TY_ARRAY:
+            out->idx = iter->count;
+            out->key.ty = JSON_TY_NUMBER;
+            out->key.inner.num = iter->count;
+            out->val = iter->inner.arr->data[iter->count];
+            json_resolve(&out->val);
+            iter->count++;
+            return true;
+        case JSON_TY_OBJECT:
+            out->idx = iter->count;
+            out->key.ty = JSON_TY_STRING;
+            const entry* current = hashmap_ordered(iter->inner.obj, iter->count);
+            out->key.inner.str = current->key;
+            out->val = *(json_value*)current->value;
+            json_resolve(&out->val);
+            iter->count++;
+            return true;
+    }
+    assert(0);
+    return false;
 }
 
-int template_eval_stream(stream* in, json_value* dot, char** out) {
-    state state;
-    state.dot = dot;
-    state.out_nospace = 0;
-    state.range_depth = 0;
-    state.return_reason = RETURN_REASON_REGULAR;
-    state.eval_block = false;
-    state.eval_arg = false;
-    hashmap_new(&state.define_locs, hashmap_strcmp, hashmap_strlen, HASH_FUNC_DJB2);
-    funcmap_new(&state.funcmap);
-    stack_new(&state.stack);
-    stack_push_frame(&state.stack);
-    int err = stack_set_ref(&state.stack, "", dot);
-    if (err) {
-        stack_pop_frame(&state.stack);
+
+#ifdef FUZZING_BUILD_MODE
+#define RANGE_DEPTH_MAX 3
+#else
+#define RANGE_DEPTH_MAX 24
+#endif
+
+int template_exec_range(state* state, const template_node* node) {
+    if (state->range_depth > RANGE_DEPTH_MAX) {
+        return ERR_BUF_OVERFLOW;
+    }
+    size_t scope = state->stack.len;
+    tracked_value iterable = TRACKED_NULL;
+    value_iter iter;
+    int err = template_exec_expr(state, node->inner.range.iterable, &iterable);
+    if (err) {
         goto cleanup;
     }
-    buf_init(&state.out);
-    err = template_run_plain(in, &state);
-    stack_pop_frame(&state.stack);
-    assert(state.stack.len == 0);
-    if (err == EOF && state.stack.len == 0) {
+    switch (iterable.val.ty) {
+        case JSON_TY_NUMBER:
+            if (node->inner.range.key_name != NULL) {
+                err = ERR_TEMPLATE_NO_ITERABLE;
+                goto cleanup;
+            }
+            break;
+        case JSON_TY_ARRAY:
+        case JSON_TY_OBJECT:
+            break;
+        default:
+            err = ERR_TEMPLATE_NO_ITERABLE;
+            goto cleanup;
+    }
+    if (is_empty(&iterable.val)) {
+        err = template_exec_list(state, node->inner.range.else_body);
+        goto cleanup;
+    }
+    if (node->inner.range.pin) {
+        template_pin(&iterable);
+    }
+    err = value_iter_new(&iter, &iterable.val);
+    if (err) {
+        goto cleanup;
+    }
+    json_value* current = state->dot;
+    value_iter_out out;
+    state->range_depth++;
+    size_t body_scope = state->stack.len;
+    while (value_iter_next(&iter, &out)) {
+        state->dot = &out.val;
+        // the slots just borrow the current element
+        if (node->inner.range.key_name != NULL) {
+            stack_set(&state->stack, node->inner.range.key_slot, out.key, false);
+        }
+        if (node->inner.range.value_name != NULL) {
+            stack_set(&state->stack, node->inner.range.value_slot, out.val, false);
+        }
+        err = template_exec_list(state, node->inner.range.body);
+        stack_pop(&state->stack, body_scope);
+        if (err) {
+            break;
+        }
+        if (state->return_reason == RETURN_REASON_BREAK) {
+            state->return_reason = RETURN_REASON_REGULAR;
+            break;
+        }
+        state->return_reason = RETURN_REASON_REGULAR;
+    }
+    state->range_depth--;
+    state->dot = current;
+cleanup:
+    tracked_value_free(&iterable);
+    stack_pop(&state->stack, scope);
+    return err;
+}
+
+int template_exec_template(state* state, const template_node* node) {
+    if (!node->inner.call.linked) {
+        return ERR_TEMPLATE_DEFINE_UNKNOWN;
+    }
+    tracked_value arg = TRACKED_NULL;
+    if (node->inner.call.arg != NULL) {
+        int err = template_exec_expr(state, node->inner.call.arg, &arg);
+        if (err) {
+            tracked_value_free(&arg);
+            return err;
+        }
+    }
+    json_value* current_dot = state->dot;
+    state->dot = &arg.val;
+    // the define's slots start past the caller's ones
+    size_t base = state->stack.base;
+    state->stack.base = state->stack.len;
+    stack_set(&state->stack, 0, arg.val, false);
+    int err = template_exec_list(state, node->inner.call.target);
+    stack_pop(&state->stack, state->stack.base);
+    state->stack.base = base;
+    state->dot = current_dot;
+    tracked_value_free(&arg);
+    return err;
+}
+
+int template_exec_list(state* state, const template_node* node) {
+    int err = 0;
+    tracked_value discard;
+    for (; node != NULL; node = node->next) {
+        switch (node->ty) {
+            case NODE_TEXT:
+                err = template_write_text(state, node->inner.text.data, node->inner.text.len);
+                break;
+            case NODE_ACTION:
+                err = template_exec_action(state, node->inner.expr);
+                if (!err && state->write != NULL && state->out.len >= TEMPLATE_SINK_CHUNK) {
+                    err = template_flush(state);
+                }
+                break;
+            case NODE_MUTATION:
+                discard = TRACKED_NULL;
+                err = template_exec_expr(state, node->inner.expr, &discard);
+                tracked_value_free(&discard);
+                break;
+            case NODE_IF:
+                err = template_exec_if(state, node);
+                break;
+            case NODE_WITH:
+                err = template_exec_with(state, node);
+                break;
+            case NODE_RANGE:
+                err = template_exec_range(state, node);
+                break;
+            case NODE_TEMPLATE:
+                err = template_exec_template(state, node);
+                break;
+            case NODE_BREAK:
+                state->return_reason = RETURN_REASON_BREAK;
+                break;
+            case NODE_CONTINUE:
+                state->return_reason = RETURN_REASON_CONTINUE;
+                break;
+        }
+        if (err) {
+            return err;
+        }
+        if (state->return_reason != RETURN_REASON_REGULAR) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// resolves the targets of all template calls within list
+void template_link(const hashmap* defines, template_node* node) {
+    for (; node != NULL; node = node->next) {
+        switch (node->ty) {
+            case NODE_IF:
+            case NODE_WITH:
+                template_link(defines, node->inner.branch.body);
+                template_link(defines, node->inner.branch.else_body);
+                break;
+            case NODE_RANGE:
+                template_link(defines, node->inner.range.body);
+                template_link(defines, node->inner.range.else_body);
+                break;
+            case NODE_TEMPLATE:
+                node->inner.call.linked = hashmap_get(defines, node->inner.call.name, (const void**)&node->inner.call.target);
+                break;
+        }
+    }
+}
+
+void template_link_define(entry* e, void* userdata) {
+    template_link((const hashmap*)userdata, e->value);
+}
+
+int template_compile_with(stream* in, const hashmap* funcmap, compiled_template* tpl) {
+    parser p;
+    p.defines = &tpl->defines;
+    p.funcmap = funcmap;
+    p.last_text = NULL;
+    p.range_depth = 0;
+    p.in_define = false;
+    p.return_reason = RETURN_REASON_REGULAR;
+    p.vars = NULL;
+    p.vars_len = 0;
+    p.vars_cap = 0;
+    p.vars_visible = 0;
+    p.slots = 0;
+    p.var_refs = 0;
+    p.var_assigns = 0;
+    parser_declare_var(&p, "");
+    tpl->root = NULL;
+    hashmap_new(&tpl->defines, hashmap_strcmp, hashmap_strlen, HASH_FUNC_WYHASH);
+    int err = template_parse_list(in, &p, &tpl->root);
+    if (err == EOF) {
         err = 0;
+    } else if (err == 0) {  // end or else without a matching pipeline
+        err = ERR_TEMPLATE_KEYWORD_UNEXPECTED;
+    }
+    parser_leave_scope(&p, 0);
+    free(p.vars);
+    if (err) {
+        compiled_template_free(tpl);
+        return err;
+    }
+    tpl->slots = p.slots;
+    // defines may be replaced until the end, so link afterwards
+    template_link(&tpl->defines, tpl->root);
+    hashmap_iter(&tpl->defines, &tpl->defines, template_link_define);
+    return 0;
+}
+
+int template_compile(stream* in, compiled_template* tpl) {
+    hashmap funcmap;
+    funcmap_new(&funcmap);
+    int err = template_compile_with(in, &funcmap, tpl);
+    funcmap_free(&funcmap);
+    return err;
+}
+
+int template_ctx_compile(template_ctx* ctx, stream* in, compiled_template* tpl) {
+    return template_compile_with(in, &ctx->funcmap, tpl);
+}
+
+// the stack and the output buffer of state need to be set up already
+int template_exec_root(state* state, const compiled_template* tpl, json_value* dot) {
+    json_resolve(dot);
+    state->tpl = tpl;
+    state->dot = dot;
+    state->range_depth = 0;
+    state->return_reason = RETURN_REASON_REGULAR;
+    stack_set(&state->stack, 0, *dot, false);
+    int err = template_exec_list(state, tpl->root);
+    stack_pop(&state->stack, 0);
+    return err;
+}
+
+int template_exec(const compiled_template* tpl, json_value* dot, char** out) {
+    state state;
+    state.write = NULL;
+    state.userdata = NULL;
+    stack_new(&state.stack, tpl->slots);
+    buf_init(&state.out);
+    int err = template_exec_root(&state, tpl, dot);
+    stack_free(&state.stack);
+    if (err) {
+        buf_free(&state.out);
+        *out = NULL;
+        return err;
     }
     buf_append(&state.out, "", 1);
     *out = state.out.data;
-cleanup:
+    return 0;
+}
+
+int template_exec_to_sink(const compiled_template* tpl, json_value* dot, template_write_func write, void* userdata) {
+    state state;
+    state.write = write;
+    state.userdata = userdata;
+    stack_new(&state.stack, tpl->slots);
+    buf_init(&state.out);
+    int err = template_exec_root(&state, tpl, dot);
+    if (!err) {
+        err = template_flush(&state);
+    }
     stack_free(&state.stack);
-    funcmap_free(&state.funcmap);
-    hashmap_iter(&state.define_locs, NULL, define_loc_free);
-    hashmap_free(&state.define_locs);
+    buf_free(&state.out);
+    return err;
+}
+
+void template_ctx_init(template_ctx* ctx) {
+    funcmap_new(&ctx->funcmap);
+    ctx->slots_cap = DEFAULT_STACK_CAP;
+    ctx->slots = malloc(sizeof(stack_slot) * ctx->slots_cap);
+    assert(ctx->slots);
+    buf out;
+    buf_init(&out);
+    ctx->out = out.data;
+    ctx->out_cap = out.cap;
+}
+
+void template_ctx_free(template_ctx* ctx) {
+    funcmap_free(&ctx->funcmap);
+    free(ctx->slots);
+    free(ctx->out);
+}
+
+// lends the stack and output storage of ctx to state
+void template_ctx_lend(template_ctx* ctx, state* state) {
+    state->stack = (stack){.base = 0, .len = 0, .cap = ctx->slots_cap, .slots = ctx->slots};
+    state->out = (buf){.data = ctx->out, .len = 0, .cap = ctx->out_cap};
+}
+
+// takes the storage back from state, which may have grown meanwhile
+void template_ctx_reclaim(template_ctx* ctx, const state* state) {
+    ctx->slots = state->stack.slots;
+    ctx->slots_cap = state->stack.cap;
+    ctx->out = state->out.data;
+    ctx->out_cap = state->out.cap;
+}
+
+int template_ctx_exec(template_ctx* ctx, const compiled_template* tpl, json_value* dot, const char** out) {
+    state state;
+    state.write = NULL;
+    state.userdata = NULL;
+    template_ctx_lend(ctx, &state);
+    int err = template_exec_root(&state, tpl, dot);
+    *out = NULL;
+    if (!err) {
+        buf_append(&state.out, "", 1);
+        *out = state.out.data;
+    }
+    template_ctx_reclaim(ctx, &state);
+    return err;
+}
+
+int template_ctx_exec_to_sink(template_ctx* ctx, const compiled_template* tpl, json_value* dot, template_write_func write, void* userdata) {
+    state state;
+    state.write = write;
+    state.userdata = userdata;
+    template_ctx_lend(ctx, &state);
+    int err = template_exec_root(&state, tpl, dot);
+    if (!err) {
+        err = template_flush(&state);
+    }
+    template_ctx_reclaim(ctx, &state);
+    return err;
+}
+
+void define_free(entry* e, void* userdata) {
+    free(e->key);
+    template_node_free(e->value);
+}
+
+void compiled_template_free(compiled_template* tpl) {
+    template_node_free(tpl->root);
+    tpl->root = NULL;
+    hashmap_iter(&tpl->defines, NULL, define_free);
+    hashmap_free(&tpl->defines);
+}
+
+int template_eval_stream(stream* in, json_value* dot, char** out) {
+    compiled_template tpl;
+    int err = template_compile(in, &tpl);
+    if (err) {
+        *out = NULL;
+        return err;
+    }
+    err = template_exec(&tpl, dot, out);
+    compiled_template_free(&tpl);
+    return err;
+}
+
+int template_eval_to_sink(stream* in, json_value* dot, template_write_func write, void* userdata) {
+    compiled_template tpl;
+    int err = template_compile(in, &tpl);
+    if (err) {
+        return err;
+    }
+    err = template_exec_to_sink(&tpl, dot, write, userdata);
+    compiled_template_free(&tpl);
     return err;
 }
 
@@ -2473,6 +2584,25 @@ int template_eval_mem(const char* tpl, size_t n, json_value* dot, char** out) {
     return err;
 }
 
+int template_ctx_eval_mem(template_ctx* ctx, const char* tpl, size_t n, json_value* dot, const char** out) {
+    stream in;
+    stream_open_memory(&in, tpl, n);
+    compiled_template compiled;
+    int err = template_ctx_compile(ctx, &in, &compiled);
+    int close_err = stream_close(&in);
+    *out = NULL;
+    if (err) {
+        return err;
+    }
+    if (close_err) {
+        compiled_template_free(&compiled);
+        return close_err;
+    }
+    err = template_ctx_exec(ctx, &compiled, dot, out);
+    compiled_template_free(&compiled);
+    return err;
+}
+
 char* template_describe_err(int err) {
     switch (err) {
         case ERR_TEMPLATE_INVALID_ESCAPE:
@@ -1,6 +1,8 @@
 #include "json.h"
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "map.h"
@@ -70,6 +72,42 @@ nutest_result json_parse_str_utf8_escape(void) {
     return NUTEST_PASS;
 }
 
+nutest_result json_parse_str_utf8_mixed(void) {
+    const char* in = "\"abcdefgh\xc3\xa4ijklmnop\\nqrstuvw\xe2\x82\xacxyz\"";
+    stream st;
+    stream_open_memory(&st, in, strlen(in));
+    json_value val;
+    int err = json_parse(&st, &val);
+    NUTEST_ASSERT(err == 0);
+    NUTEST_ASSERT(val.ty == JSON_TY_STRING);
+    NUTEST_ASSERT(strcmp(val.inner.str, "abcdefgh\xc3\xa4ijklmnop\nqrstuvw\xe2\x82\xacxyz") == 0);
+    json_value_free(&val);
+    stream_close(&st);
+    return NUTEST_PASS;
+}
+
+nutest_result json_parse_str_invalid_utf8(void) {
+    const char* in = "\"abcdefghijklmnop\xe2\x28\xa1\"";
+    stream st;
+    stream_open_memory(&st, in, strlen(in));
+    json_value val;
+    int err = json_parse(&st, &val);
+    NUTEST_ASSERT(err == ERR_INVALID_UTF8);
+    stream_close(&st);
+    return NUTEST_PASS;
+}
+
+nutest_result json_parse_str_control(void) {
+    const char* in = "\"abcdefghijklm\tnop\"";
+    stream st;
+    stream_open_memory(&st, in, strlen(in));
+    json_value val;
+    int err = json_parse(&st, &val);
+    NUTEST_ASSERT(err == ERR_JSON_INVALID_SYNTAX);
+    stream_close(&st);
+    return NUTEST_PASS;
+}
+
 nutest_result json_parse_number_generic(const char* in, double expected) {
     stream st;
     stream_open_memory(&st, in, strlen(in));
@@ -148,6 +186,35 @@ nutest_result json_parse_number_double_e(void) {
     return json_parse_number_fail("123e5e2");
 }
 
+nutest_result json_parse_number_overflow(void) {
+    return json_parse_number_fail("[1e400]");
+}
+
+nutest_result json_parse_number_dot_e(void) {
+    return json_parse_number_fail("[1.e5]");
+}
+
+nutest_result json_parse_number_stale_errno(void) {
+    errno = ERANGE;
+    return json_parse_number_generic("1.5", 1.5);
+}
+
+nutest_result json_parse_number_rounding(void) {
+    const char* in = "[0.1, 9007199254740993, 123456789012345678901, 5e-324, 1.7976931348623157e308, 2.2250738585072011e-308]";
+    const char* expected[] = {"0.1", "9007199254740993", "123456789012345678901", "5e-324", "1.7976931348623157e308", "2.2250738585072011e-308"};
+    stream st;
+    stream_open_memory(&st, in, strlen(in));
+    json_value val;
+    NUTEST_ASSERT(json_parse(&st, &val) == 0);
+    NUTEST_ASSERT(val.inner.arr.len == 6);
+    for (size_t i = 0; i < 6; i++) {
+        NUTEST_ASSERT(val.inner.arr.data[i].inner.num == strtod(expected[i], NULL));
+    }
+    json_value_free(&val);
+    stream_close(&st);
+    return NUTEST_PASS;
+}
+
 nutest_result json_parse_array_empty(void) {
     stream st;
     stream_open_memory(&st, " [ ]", 4);
@@ -269,6 +336,295 @@ nutest_result json_parse_obj_double(void) {
     return NUTEST_PASS;
 }
 
+// parses in with the streaming parser from memory and through a
+// buffered stream, and with the indexed parser into an arena, expecting
+// the same result. Every parser has to fail at the same offset.
+nutest_result assert_json_parsers_agree(const char* in, int expected_err) {
+    stream st;
+    stream_open_memory(&st, in, strlen(in));
+    json_value mem;
+    int err = json_parse(&st, &mem);
+    NUTEST_ASSERT(err == expected_err);
+    long expected_pos;
+    long pos;
+    NUTEST_ASSERT(stream_pos(&st, &expected_pos) == 0);
+    stream_close(&st);
+
+    stream_open_memory(&st, in, strlen(in));
+    json_arena arena;
+    json_arena_init(&arena);
+    json_value arena_val;
+    err = json_parse_arena(&st, &arena_val, &arena);
+    NUTEST_ASSERT(err == expected_err);
+    NUTEST_ASSERT(stream_pos(&st, &pos) == 0 && pos == expected_pos);
+    stream_close(&st);
+    if (expected_err == 0) {
+        NUTEST_ASSERT(json_value_equal(&mem, &arena_val));
+    }
+    json_arena_free(&arena);
+
+    char* insitu_in = strdup(in);
+    NUTEST_ASSERT(insitu_in);
+    stream_open_memory(&st, insitu_in, strlen(insitu_in));
+    json_arena_init(&arena);
+    json_value insitu;
+    err = json_parse_insitu(&st, &insitu, &arena);
+    NUTEST_ASSERT(err == expected_err);
+    NUTEST_ASSERT(stream_pos(&st, &pos) == 0 && pos == expected_pos);
+    stream_close(&st);
+    if (expected_err == 0) {
+        NUTEST_ASSERT(json_value_equal(&mem, &insitu));
+    }
+    json_arena_free(&arena);
+    free(insitu_in);
+
+    stream_open_memory(&st, in, strlen(in));
+    json_arena_init(&arena);
+    json_value lazy;
+    err = json_parse_lazy(&st, &lazy, &arena);
+    NUTEST_ASSERT(err == expected_err);
+    NUTEST_ASSERT(stream_pos(&st, &pos) == 0 && pos == expected_pos);
+    stream_close(&st);
+    if (expected_err == 0) {
+        NUTEST_ASSERT(json_value_equal(&mem, &lazy));
+    }
+    json_arena_free(&arena);
+
+    FILE* file = tmpfile();
+    NUTEST_ASSERT(file);
+    NUTEST_ASSERT(fputs(in, file) != EOF);
+    rewind(file);
+    stream_open_buffered(&st, file);
+    json_value streamed;
+    err = json_parse(&st, &streamed);
+    NUTEST_ASSERT(err == expected_err);
+    NUTEST_ASSERT(stream_pos(&st, &pos) == 0 && pos == expected_pos);
+    stream_close(&st);
+    NUTEST_ASSERT(fclose(file) == 0);
+    if (expected_err == 0) {
+        NUTEST_ASSERT(json_value_equal(&mem, &streamed));
+        json_value_free(&mem);
+        json_value_free(&streamed);
+    }
+    return NUTEST_PASS;
+}
+
+nutest_result json_parse_indexed_nested(void) {
+    return assert_json_parsers_agree(" {\"a\": [1, -2.5e3, {\"b\": \"c\\\"d\"}, [], {}], \"e\": [true, false, null]} ", 0);
+}
+
+nutest_result json_parse_indexed_trailing(void) {
+    return assert_json_parsers_agree("[1, 2] 3 ]", 0);
+}
+
+nutest_result json_parse_indexed_missing_comma(void) {
+    return assert_json_parsers_agree("[1 2]", ERR_JSON_INVALID_SYNTAX);
+}
+
+nutest_result json_parse_indexed_truncated(void) {
+    return assert_json_parsers_agree("{\"a\": [1, ", EOF);
+}
+
+nutest_result json_parse_indexed_bad_literal(void) {
+    return assert_json_parsers_agree("[truex]", ERR_JSON_INVALID_SYNTAX);
+}
+
+nutest_result assert_json_err_pos(const char* in, int expected_err, long expected_pos) {
+    stream st;
+    stream_open_memory(&st, in, strlen(in));
+    json_value val;
+    NUTEST_ASSERT(json_parse(&st, &val) == expected_err);
+    long pos;
+    NUTEST_ASSERT(stream_pos(&st, &pos) == 0);
+    NUTEST_ASSERT(pos == expected_pos);
+    return assert_json_parsers_agree(in, expected_err);
+}
+
+nutest_result json_parse_err_pos_number(void) {
+    return assert_json_err_pos("[1e400]", ERR_JSON_INVALID_SYNTAX, 7);
+}
+
+nutest_result json_parse_err_pos_number_last(void) {
+    return assert_json_err_pos("[1, 2.]", ERR_JSON_INVALID_SYNTAX, 7);
+}
+
+nutest_result json_parse_err_pos_literal(void) {
+    return assert_json_err_pos("nul", EOF, 3);
+}
+
+nutest_result json_parse_err_pos_utf8(void) {
+    return assert_json_err_pos("\"\xff\"", ERR_INVALID_UTF8, 2);
+}
+
+nutest_result json_parse_err_pos_token(void) {
+    return assert_json_err_pos("{\"a\": [1, 2, x]}", ERR_JSON_INVALID_SYNTAX, 14);
+}
+
+nutest_result json_parse_arena_unsupported(void) {
+    FILE* file = tmpfile();
+    NUTEST_ASSERT(file);
+    stream st;
+    stream_open_buffered(&st, file);
+    json_arena arena;
+    json_arena_init(&arena);
+    json_value val;
+    NUTEST_ASSERT(json_parse_arena(&st, &val, &arena) == ERR_JSON_UNSUPPORTED_STREAM);
+    json_arena_free(&arena);
+    stream_close(&st);
+    NUTEST_ASSERT(fclose(file) == 0);
+    return NUTEST_PASS;
+}
+
+nutest_result json_parse_arena_reset(void) {
+    const char* docs[] = {"{\"a\": [1, 2, \"x\\ny\"]}", "[{\"b\": true}, null]", "\"c\""};
+    json_arena arena;
+    json_arena_init(&arena);
+    for (size_t i = 0; i < sizeof(docs) / sizeof(docs[0]); i++) {
+        stream st;
+        stream_open_memory(&st, docs[i], strlen(docs[i]));
+        json_value expected;
+        NUTEST_ASSERT(json_parse(&st, &expected) == 0);
+        stream_close(&st);
+        // the buffers of the previous document are reused
+        json_arena_reset(&arena);
+        stream_open_memory(&st, docs[i], strlen(docs[i]));
+        json_value val;
+        NUTEST_ASSERT(json_parse_arena(&st, &val, &arena) == 0);
+        stream_close(&st);
+        NUTEST_ASSERT(json_value_equal(&expected, &val));
+        json_value_free(&expected);
+    }
+    json_arena_free(&arena);
+    return NUTEST_PASS;
+}
+
+nutest_result json_parse_insitu_reference(void) {
+    char in[] = "{\"a\": \"plain\", \"b\": \"esc\\naped\"}";
+    stream st;
+    stream_open_memory(&st, in, strlen(in));
+    json_arena arena;
+    json_arena_init(&arena);
+    json_value val;
+    NUTEST_ASSERT(json_parse_insitu(&st, &val, &arena) == 0);
+    stream_close(&st);
+    json_value* a;
+    NUTEST_ASSERT(hashmap_get(&val.inner.obj, "a", (const void**)&a));
+    NUTEST_ASSERT(a->inner.str == in + 7);
+    NUTEST_ASSERT(strcmp(a->inner.str, "plain") == 0);
+    json_value* b;
+    NUTEST_ASSERT(hashmap_get(&val.inner.obj, "b", (const void**)&b));
+    NUTEST_ASSERT(b->inner.str < in || b->inner.str >= in + sizeof(in));
+    NUTEST_ASSERT(strcmp(b->inner.str, "esc\naped") == 0);
+    json_arena_free(&arena);
+    return NUTEST_PASS;
+}
+
+nutest_result json_parse_lazy_resolve(void) {
+    const char* in = "{\"a\": [1, {\"b\": \"c\"}], \"d\": {}}";
+    stream st;
+    stream_open_memory(&st, in, strlen(in));
+    json_arena arena;
+    json_arena_init(&arena);
+    json_value val;
+    NUTEST_ASSERT(json_parse_lazy(&st, &val, &arena) == 0);
+    stream_close(&st);
+    NUTEST_ASSERT(val.ty == JSON_TY_LAZY);
+    json_resolve(&val);
+    NUTEST_ASSERT(val.ty == JSON_TY_OBJECT);
+    json_value* a;
+    NUTEST_ASSERT(hashmap_get(&val.inner.obj, "a", (const void**)&a));
+    NUTEST_ASSERT(a->ty == JSON_TY_LAZY);
+    json_resolve(a);
+    NUTEST_ASSERT(a->ty == JSON_TY_ARRAY);
+    NUTEST_ASSERT(a->inner.arr.len == 2);
+    NUTEST_ASSERT(a->inner.arr.data[0].inner.num == 1.0);
+    NUTEST_ASSERT(a->inner.arr.data[1].ty == JSON_TY_LAZY);
+    json_arena_free(&arena);
+    return NUTEST_PASS;
+}
+
+nutest_result json_parse_lazy_reset(void) {
+    const char* in[] = {"[{\"a\": 1}, [2]]", "{\"b\": [3, 4]}"};
+    json_arena arena;
+    json_arena_init(&arena);
+    for (size_t i = 0; i < 2; i++) {
+        // both documents stay resolvable until the arena is reset
+        stream st;
+        stream_open_memory(&st, in[0], strlen(in[0]));
+        json_value first;
+        NUTEST_ASSERT(json_parse_lazy(&st, &first, &arena) == 0);
+        stream_close(&st);
+        stream_open_memory(&st, in[1], strlen(in[1]));
+        json_value second;
+        NUTEST_ASSERT(json_parse_lazy(&st, &second, &arena) == 0);
+        stream_close(&st);
+        json_resolve(&first);
+        NUTEST_ASSERT(first.ty == JSON_TY_ARRAY && first.inner.arr.len == 2);
+        json_resolve(first.inner.arr.data + 1);
+        NUTEST_ASSERT(first.inner.arr.data[1].inner.arr.data[0].inner.num == 2.0);
+        json_resolve(&second);
+        json_value* b;
+        NUTEST_ASSERT(hashmap_get(&second.inner.obj, "b", (const void**)&b));
+        json_resolve(b);
+        NUTEST_ASSERT(b->ty == JSON_TY_ARRAY && b->inner.arr.len == 2);
+        json_arena_reset(&arena);
+    }
+    json_arena_free(&arena);
+    return NUTEST_PASS;
+}
+
+nutest_result json_parse_lazy_modified(void) {
+    char in[] = "[[1]]";
+    stream st;
+    stream_open_memory(&st, in, strlen(in));
+    json_arena arena;
+    json_arena_init(&arena);
+    json_value val;
+    NUTEST_ASSERT(json_parse_lazy(&st, &val, &arena) == 0);
+    stream_close(&st);
+    json_resolve(&val);
+    in[2] = 'x';
+    json_resolve(val.inner.arr.data);
+    NUTEST_ASSERT(val.inner.arr.data[0].ty == JSON_TY_NULL);
+    json_arena_free(&arena);
+    return NUTEST_PASS;
+}
+
+nutest_result json_parse_lazy_invalid_nested(void) {
+    const char* in = "{\"a\": [1, {\"b\" \"c\"}]}";
+    stream st;
+    stream_open_memory(&st, in, strlen(in));
+    json_arena arena;
+    json_arena_init(&arena);
+    json_value val;
+    NUTEST_ASSERT(json_parse_lazy(&st, &val, &arena) == ERR_JSON_INVALID_SYNTAX);
+    stream_close(&st);
+    json_arena_free(&arena);
+    return NUTEST_PASS;
+}
+
+nutest_result json_parse_arena_interned_keys(void) {
+    const char* in = "[{\"id\": 1, \"name\": \"a\"}, {\"name\": \"b\", \"id\": 2}]";
+    stream st;
+    stream_open_memory(&st, in, strlen(in));
+    json_arena arena;
+    json_arena_init(&arena);
+    json_value val;
+    NUTEST_ASSERT(json_parse_arena(&st, &val, &arena) == 0);
+    stream_close(&st);
+    hashmap* first = &val.inner.arr.data[0].inner.obj;
+    hashmap* second = &val.inner.arr.data[1].inner.obj;
+    hashmap_order(first);
+    hashmap_order(second);
+    NUTEST_ASSERT(hashmap_ordered(first, 0)->key == hashmap_ordered(second, 0)->key);
+    NUTEST_ASSERT(hashmap_ordered(first, 1)->key == hashmap_ordered(second, 1)->key);
+    json_value* id;
+    NUTEST_ASSERT(hashmap_get_hashed(&val.inner.arr.data[1].inner.obj, "id", json_key_hash("id"), (const void**)&id));
+    NUTEST_ASSERT(id->inner.num == 2);
+    json_arena_free(&arena);
+    return NUTEST_PASS;
+}
+
 nutest_result assert_json_value_copy(const char* str) {
     stream st;
     stream_open_memory(&st, str, strlen(str));
@@ -422,6 +778,9 @@ int main() {
     nutest_register(json_parse_str_long);
     nutest_register(json_parse_str_escape);
     nutest_register(json_parse_str_utf8_escape);
+    nutest_register(json_parse_str_utf8_mixed);
+    nutest_register(json_parse_str_invalid_utf8);
+    nutest_register(json_parse_str_control);
     nutest_register(json_parse_number_positive);
     nutest_register(json_parse_number_frac);
     nutest_register(json_parse_number_negative);
@@ -436,6 +795,10 @@ int main() {
     nutest_register(json_parse_number_hex);
     nutest_register(json_parse_number_double_dot);
     nutest_register(json_parse_number_double_e);
+    nutest_register(json_parse_number_overflow);
+    nutest_register(json_parse_number_dot_e);
+    nutest_register(json_parse_number_stale_errno);
+    nutest_register(json_parse_number_rounding);
     nutest_register(json_parse_array_empty);
     nutest_register(json_parse_array_numbers);
     nutest_register(json_parse_array_nested);
@@ -443,6 +806,24 @@ int main() {
     nutest_register(json_parse_obj_str_single);
     nutest_register(json_parse_obj_str_multi);
     nutest_register(json_parse_obj_double);
+    nutest_register(json_parse_indexed_nested);
+    nutest_register(json_parse_indexed_trailing);
+    nutest_register(json_parse_indexed_missing_comma);
+    nutest_register(json_parse_indexed_truncated);
+    nutest_register(json_parse_indexed_bad_literal);
+    nutest_register(json_parse_err_pos_number);
+    nutest_register(json_parse_err_pos_number_last);
+    nutest_register(json_parse_err_pos_literal);
+    nutest_register(json_parse_err_pos_utf8);
+    nutest_register(json_parse_err_pos_token);
+    nutest_register(json_parse_arena_unsupported);
+    nutest_register(json_parse_arena_reset);
+    nutest_register(json_parse_insitu_reference);
+    nutest_register(json_parse_lazy_resolve);
+    nutest_register(json_parse_lazy_reset);
+    nutest_register(json_parse_lazy_modified);
+    nutest_register(json_parse_lazy_invalid_nested);
+    nutest_register(json_parse_arena_interned_keys);
     nutest_register(json_value_copy_null);
     nutest_register(json_value_copy_true);
     nutest_register(json_value_copy_false);
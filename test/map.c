@@ -83,6 +83,43 @@ nutest_result map_add_few(void) {
     return NUTEST_PASS;
 }
 
+nutest_result map_small_to_hashed(void) {
+    hashmap map;
+    hashmap_new(&map, map_strcmp, map_strlen, HASH_FUNC_DJB2);
+    char* keys[10] = {"a", "b", "c", "d", "e", "f", "g", "h", "i", "j"};
+    for (size_t i = 0; i < 10; i++) {
+        entry prev = hashmap_insert(&map, keys[i], keys[i]);
+        NUTEST_ASSERT(prev.key == NULL);
+        prev = hashmap_insert(&map, keys[0], keys[i]);
+        NUTEST_ASSERT(prev.exists);
+    }
+    NUTEST_ASSERT(map.count == 10);
+    for (size_t i = 1; i < 10; i++) {
+        const char* result = NULL;
+        NUTEST_ASSERT(hashmap_get(&map, keys[i], (const void**)&result));
+        NUTEST_ASSERT(result == keys[i]);
+    }
+    const char* result = NULL;
+    NUTEST_ASSERT(hashmap_get(&map, "a", (const void**)&result));
+    NUTEST_ASSERT(result == keys[9]);
+    NUTEST_ASSERT(!hashmap_get(&map, "k", (const void**)&result));
+    hashmap_free(&map);
+    return NUTEST_PASS;
+}
+
+nutest_result map_init_empty(void) {
+    hashmap map;
+    hashmap_init(&map, map_strcmp, map_strlen, HASH_FUNC_DJB2, NULL, hashmap_cap_for(0));
+    const char* result = NULL;
+    NUTEST_ASSERT(!hashmap_get(&map, "a", (const void**)&result));
+    entry prev = hashmap_insert(&map, "a", "b");
+    NUTEST_ASSERT(prev.key == NULL);
+    NUTEST_ASSERT(hashmap_get(&map, "a", (const void**)&result));
+    NUTEST_ASSERT(strcmp(result, "b") == 0);
+    hashmap_free(&map);
+    return NUTEST_PASS;
+}
+
 int map_sizetcmp(const void* a, const void* b) {
     size_t x = (size_t)a;
     size_t y = (size_t)b;
@@ -118,6 +155,89 @@ nutest_result map_add_many(void) {
     return NUTEST_PASS;
 }
 
+nutest_result map_init_cap(void) {
+    size_t count = 100;
+    size_t cap = hashmap_cap_for(count);
+    entry* data = calloc(1, hashmap_data_size(cap));
+    NUTEST_ASSERT(data);
+    hashmap map;
+    hashmap_init(&map, map_sizetcmp, map_sizetlen, HASH_FUNC_IDENTITY, data, cap);
+    for (size_t i = 0; i < count; i++) {
+        entry prev = hashmap_insert(&map, (void*)(i * 64), (void*)i);
+        NUTEST_ASSERT(!prev.exists);
+    }
+    // enough entries were requested to not grow
+    NUTEST_ASSERT(map.data == data);
+    for (size_t i = 0; i < count; i++) {
+        size_t result;
+        NUTEST_ASSERT(hashmap_get(&map, (void*)(i * 64), (const void**)&result));
+        NUTEST_ASSERT(result == i);
+    }
+    hashmap_clear(&map);
+    NUTEST_ASSERT(map.count == 0);
+    size_t result;
+    NUTEST_ASSERT(!hashmap_get(&map, (void*)64, (const void**)&result));
+    entry prev = hashmap_insert(&map, (void*)64, (void*)1);
+    NUTEST_ASSERT(!prev.exists);
+    NUTEST_ASSERT(hashmap_get(&map, (void*)64, (const void**)&result));
+    NUTEST_ASSERT(result == 1);
+    hashmap_free(&map);
+    return NUTEST_PASS;
+}
+
+nutest_result map_wyhash_seeded(void) {
+    hashmap map;
+    hashmap_new(&map, map_strcmp, map_strlen, HASH_FUNC_WYHASH);
+    size_t unseeded = hashmap_hash(&map, "key");
+    hashmap_seed(42);
+    NUTEST_ASSERT(hashmap_hash(&map, "key") != unseeded);
+    char keys[100][8];
+    for (size_t i = 0; i < 100; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "k%zu", i);
+        entry prev = hashmap_insert(&map, keys[i], keys[i]);
+        NUTEST_ASSERT(!prev.exists);
+    }
+    for (size_t i = 0; i < 100; i++) {
+        const char* result = NULL;
+        NUTEST_ASSERT(hashmap_get(&map, keys[i], (const void**)&result));
+        NUTEST_ASSERT(result == keys[i]);
+    }
+    const char* result = NULL;
+    NUTEST_ASSERT(!hashmap_get(&map, "k100", (const void**)&result));
+    hashmap_free(&map);
+    hashmap_seed(0);
+    return NUTEST_PASS;
+}
+
+bool map_ordered(hashmap* map) {
+    hashmap_order(map);
+    for (size_t i = 1; i < map->count; i++) {
+        if (strcmp(hashmap_ordered(map, i - 1)->key, hashmap_ordered(map, i)->key) >= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+nutest_result map_order(void) {
+    hashmap map;
+    hashmap_new(&map, map_strcmp, map_strlen, HASH_FUNC_WYHASH);
+    char keys[40][8];
+    for (size_t i = 0; i < 40; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "%zu", (i * 17) % 40);
+        hashmap_insert(&map, keys[i], keys[i]);
+        // small and hashed maps, the latter after adding a key
+        NUTEST_ASSERT(map_ordered(&map));
+    }
+    NUTEST_ASSERT(strcmp(hashmap_ordered(&map, 0)->key, "0") == 0);
+    NUTEST_ASSERT(strcmp(hashmap_ordered(&map, 39)->key, "9") == 0);
+    // replacing a value keeps the order
+    hashmap_insert(&map, "9", "x");
+    NUTEST_ASSERT(strcmp(hashmap_ordered(&map, 39)->value, "x") == 0);
+    hashmap_free(&map);
+    return NUTEST_PASS;
+}
+
 void map_sum(entry* e, void* userdata) {
     size_t* sum = (size_t*)userdata;
     *sum += (size_t)e->key;
@@ -156,7 +276,12 @@ int main() {
     nutest_register(map_add_prev);
     nutest_register(map_miss);
     nutest_register(map_add_few);
+    nutest_register(map_small_to_hashed);
+    nutest_register(map_init_empty);
     nutest_register(map_add_many);
+    nutest_register(map_init_cap);
+    nutest_register(map_wyhash_seeded);
+    nutest_register(map_order);
     nutest_register(map_iter);
     nutest_register(map_keys);
     return nutest_run();
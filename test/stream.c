@@ -48,6 +48,129 @@ nutest_result stream_file() {
     return NUTEST_PASS;
 }
 
+nutest_result stream_mmap() {
+    const char* path = "stream_mmap.txt";
+    remove(path);
+    FILE* file = fopen(path, "wb");
+    NUTEST_ASSERT(file);
+    size_t written = fwrite("xyz", sizeof(char), 3, file);
+    NUTEST_ASSERT(written == 3);
+    NUTEST_ASSERT(fclose(file) == 0);
+
+    stream st;
+    int err = stream_open_mmap(&st, path);
+    if (err == ERR_MMAP_UNSUPPORTED) {
+        remove(path);
+        return NUTEST_PASS;
+    }
+    NUTEST_ASSERT(err == 0);
+    unsigned char out;
+    NUTEST_ASSERT(stream_read(&st, &out) == 0);
+    NUTEST_ASSERT(out == 'x');
+    NUTEST_ASSERT(stream_seek(&st, 1) == 0);
+    NUTEST_ASSERT(stream_read(&st, &out) == 0);
+    NUTEST_ASSERT(out == 'z');
+    NUTEST_ASSERT(stream_read(&st, &out) == EOF);
+    NUTEST_ASSERT(stream_set_pos(&st, 1) == 0);
+    NUTEST_ASSERT(stream_read(&st, &out) == 0);
+    NUTEST_ASSERT(out == 'y');
+    NUTEST_ASSERT(stream_close(&st) == 0);
+    remove(path);
+    return NUTEST_PASS;
+}
+
+nutest_result stream_mmap_empty() {
+    const char* path = "stream_mmap_empty.txt";
+    remove(path);
+    FILE* file = fopen(path, "wb");
+    NUTEST_ASSERT(file);
+    NUTEST_ASSERT(fclose(file) == 0);
+
+    stream st;
+    int err = stream_open_mmap(&st, path);
+    if (err == ERR_MMAP_UNSUPPORTED) {
+        remove(path);
+        return NUTEST_PASS;
+    }
+    NUTEST_ASSERT(err == 0);
+    unsigned char out;
+    NUTEST_ASSERT(stream_read(&st, &out) == EOF);
+    NUTEST_ASSERT(stream_close(&st) == 0);
+    remove(path);
+    return NUTEST_PASS;
+}
+
+nutest_result stream_buffered() {
+    FILE* file = tmpfile();
+    NUTEST_ASSERT(file);
+    // larger than the buffer to force refills
+    for (size_t i = 0; i < STREAM_BUFFER_CAP * 2 + 7; i++) {
+        NUTEST_ASSERT(fputc('a' + i % 26, file) != EOF);
+    }
+    rewind(file);
+
+    stream st;
+    stream_open_buffered(&st, file);
+    unsigned char out;
+    for (size_t i = 0; i < STREAM_BUFFER_CAP * 2 + 7; i++) {
+        NUTEST_ASSERT(stream_read(&st, &out) == 0);
+        NUTEST_ASSERT(out == 'a' + i % 26);
+        if (i == STREAM_BUFFER_CAP + 3) {
+            long pos;
+            NUTEST_ASSERT(stream_pos(&st, &pos) == 0);
+            NUTEST_ASSERT(pos == STREAM_BUFFER_CAP + 4);
+            NUTEST_ASSERT(stream_seek(&st, -STREAM_LOOKBACK) == 0);
+            NUTEST_ASSERT(stream_read(&st, &out) == 0);
+            NUTEST_ASSERT(out == 'a' + (i + 1 - STREAM_LOOKBACK) % 26);
+            NUTEST_ASSERT(stream_set_pos(&st, pos) == 0);
+        }
+    }
+    NUTEST_ASSERT(stream_read(&st, &out) == EOF);
+    NUTEST_ASSERT(stream_set_pos(&st, 0) != 0);
+    NUTEST_ASSERT(stream_close(&st) == 0);
+    NUTEST_ASSERT(fclose(file) == 0);
+    return NUTEST_PASS;
+}
+
+nutest_result stream_buffered_read_err() {
+    const char* path = "stream_buffered_read_err.txt";
+    remove(path);
+    // reading from a file opened for writing only fails
+    FILE* file = fopen(path, "wb");
+    NUTEST_ASSERT(file);
+    stream st;
+    stream_open_buffered(&st, file);
+    unsigned char out;
+    int err = stream_read(&st, &out);
+    NUTEST_ASSERT(err != 0 && err != EOF);
+    const unsigned char* span;
+    size_t span_len;
+    err = stream_peek(&st, &span, &span_len);
+    NUTEST_ASSERT(err != 0 && err != EOF);
+    NUTEST_ASSERT(stream_close(&st) == 0);
+    NUTEST_ASSERT(fclose(file) == 0);
+    remove(path);
+    return NUTEST_PASS;
+}
+
+nutest_result stream_memory_peek() {
+    const char data[4] = {'a', 'b', 'c', 'd'};
+    stream st;
+    stream_open_memory(&st, data, sizeof(data));
+    const unsigned char* span;
+    size_t span_len;
+    NUTEST_ASSERT(stream_peek(&st, &span, &span_len) == 0);
+    NUTEST_ASSERT(span_len == 4);
+    NUTEST_ASSERT(span[0] == 'a');
+    stream_advance(&st, 3);
+    unsigned char out;
+    NUTEST_ASSERT(stream_read(&st, &out) == 0);
+    NUTEST_ASSERT(out == 'd');
+    NUTEST_ASSERT(stream_peek(&st, &span, &span_len) == EOF);
+    NUTEST_ASSERT(stream_close(&st) == 0);
+    return NUTEST_PASS;
+}
+
 nutest_result stream_memory_pos() {
     const char data[4] = {'a', 'b', 'c', 'd'};
     stream st;
@@ -221,7 +344,12 @@ nutest_result stream_utf8_surrogate(void) {
 int main() {
     nutest_register(stream_memory);
     nutest_register(stream_file);
+    nutest_register(stream_mmap);
+    nutest_register(stream_mmap_empty);
+    nutest_register(stream_buffered);
+    nutest_register(stream_buffered_read_err);
     nutest_register(stream_memory_pos);
+    nutest_register(stream_memory_peek);
     nutest_register(stream_file_pos);
     nutest_register(stream_utf8_single);
     nutest_register(stream_utf8_multi);
@@ -43,6 +43,19 @@ nutest_result assert_eval_data(const char* tpl, const char* data, const char* ex
     NUTEST_ASSERT(strcmp(expected, out) == 0);
     free(out);
     json_value_free(&val);
+
+    // lazily decoded data has to render the same
+    stream st;
+    stream_open_memory(&st, data, strlen(data));
+    json_arena arena;
+    json_arena_init(&arena);
+    NUTEST_ASSERT(json_parse_lazy(&st, &val, &arena) == 0);
+    stream_close(&st);
+    err = template_eval_mem(tpl, strlen(tpl), &val, &out);
+    NUTEST_ASSERT(err == 0);
+    NUTEST_ASSERT(strcmp(expected, out) == 0);
+    free(out);
+    json_arena_free(&arena);
     return NUTEST_PASS;
 }
 
@@ -62,6 +75,18 @@ nutest_result template_identity(void) {
     return assert_eval_null(" abc{  def  ghi", " abc{  def  ghi");
 }
 
+nutest_result template_identity_utf8(void) {
+    return assert_eval_null("\xc3\xa4 \xe2\x82\xac{x\xf0\x9f\x98\x80{{ 1 }}", "\xc3\xa4 \xe2\x82\xac{x\xf0\x9f\x98\x80" "1");
+}
+
+nutest_result template_text_invalid_utf8(void) {
+    return assert_eval_err("abc\xc3\x28{{ 1 }}", ERR_INVALID_UTF8);
+}
+
+nutest_result template_text_surrogate(void) {
+    return assert_eval_err("a\xed\xa0\x80", ERR_INVALID_UTF8);
+}
+
 nutest_result template_empty_pipeline(void) {
     return assert_eval_err(" x{{}} y", ERR_TEMPLATE_INVALID_SYNTAX);
 }
@@ -118,6 +143,10 @@ nutest_result template_print_negative_number(void) {
     return assert_eval_null("b {{- -24 }}c", "b-24c");
 }
 
+nutest_result template_print_denormal_number(void) {
+    return assert_eval_null("{{ 5e-324 }} {{ -1e-400 }}", "5e-324 0");
+}
+
 nutest_result template_print_regular_str(void) {
     return assert_eval_null("d {{- \"hello\" }}e", "dhelloe");
 }
@@ -130,6 +159,11 @@ nutest_result template_print_list_elems(void) {
     return assert_eval_data("{{.}}", "[2,4,8]", "[2 4 8]");
 }
 
+nutest_result template_print_numbers(void) {
+    return assert_eval_data("{{ range . }}{{ . }} {{ end }}", "[123456, 1234567, 19.99, 0.0001, 0.00001, 123456789.5, -0, 1e21, 5e-324]",
+                            "123456 1.234567e+06 19.99 0.0001 1e-05 1.234567895e+08 -0 1e+21 5e-324 ");
+}
+
 nutest_result template_print_list_empty(void) {
     return assert_eval_data("{{.}}", "[]", "[]");
 }
@@ -142,6 +176,20 @@ nutest_result template_print_obj_elems(void) {
     return assert_eval_data("{{.}}", "{\"a\":null, \"b\": 45}", "map[a:<nil> b:45]");
 }
 
+nutest_result template_print_obj_sorted(void) {
+    return assert_eval_data("{{.}} {{ printf \"%s\" . }}", "{\"b\": \"x\", \"1\": \"y\", \"a\": \"z\"}", "map[1:y a:z b:x] map[1:y a:z b:x]");
+}
+
+nutest_result template_var_nested_copy(void) {
+    return assert_eval_data("{{ $a := .a }}{{ with $a }}{{ .b.c }}{{ end }} {{ index $a \"b\" \"c\" }} {{ $a }}", "{\"a\": {\"b\": {\"c\": [1]}}}", "[1] [1] map[b:map[c:[1]]]");
+}
+
+nutest_result template_range_obj_nested(void) {
+    return assert_eval_data("{{ range $k, $v := . }}{{ $k }}{{ range $k2, $v2 := $ }}{{ if eq $k $k2 }}={{ $v2 }}{{ end }}{{ end }};{{ end }} {{ . }}",
+                            "{\"j\":10,\"b\":2,\"i\":9,\"a\":1,\"h\":8,\"c\":3,\"g\":7,\"d\":4,\"f\":6,\"e\":5}",
+                            "a=1;b=2;c=3;d=4;e=5;f=6;g=7;h=8;i=9;j=10; map[a:1 b:2 c:3 d:4 e:5 f:6 g:7 h:8 i:9 j:10]");
+}
+
 nutest_result template_print_obj_empty(void) {
     return assert_eval_data("{{.}}", "{}", "map[]");
 }
@@ -396,6 +444,10 @@ nutest_result template_var_scope_kept(void) {
     return assert_eval_null("{{$z := true}}{{with 137}}text {{end}}{{$z}}", "text true");
 }
 
+nutest_result template_var_scope_assign(void) {
+    return assert_eval_null("{{$z := 1}}{{with 2}}{{$z = 3}}{{end}}{{$z}}", "3");
+}
+
 nutest_result template_var_scope_lost(void) {
     return assert_eval_err("{{ with $ }}{{$y := 3}}{{end}}{{$y}}", ERR_TEMPLATE_VAR_UNKNOWN);
 }
@@ -412,6 +464,18 @@ nutest_result template_loop_var_map(void) {
     return assert_eval_data("{{ range $key,$val := . -}} {{ $key }}{{ $val }} {{- end }}", "{\"a\": 9, \"b\": 8}", "a9b8");
 }
 
+nutest_result template_loop_var_body_declare(void) {
+    return assert_eval_data("{{ range $v := . }}{{ $s := $v }}{{ $v = `x` }}{{ $s }}{{ $v }}{{ end }}", "[1,2,3]", "1x2x3x");
+}
+
+nutest_result template_loop_var_assign_outer(void) {
+    return assert_eval_data("{{ $last := 0 }}{{ range . }}{{ $last = . }}{{ end }}{{ $last }}", "[1,2,3]", "3");
+}
+
+nutest_result template_loop_var_reassign_iterable(void) {
+    return assert_eval_data("{{ $x := . }}{{ range $x }}{{ . }}{{ $x = 0 }}{{ end }}{{ $x }}", "[1,2,3]", "1230");
+}
+
 nutest_result template_func_not_true(void) {
     return assert_eval_null("{{ not true }}", "false");
 }
@@ -577,6 +641,10 @@ nutest_result template_define_change_dot(void) {
     return assert_eval_null("{{ define `y` }}{{.}}{{end}}{{ template `y` 8 }}", "8");
 }
 
+nutest_result template_define_dollar(void) {
+    return assert_eval_null("{{ define `d` }}{{ $ }}{{ end }}{{ $x := 1 }}{{ template `d` 5 }}", "5");
+}
+
 nutest_result template_define_no_name(void) {
     return assert_eval_err("{{ define }}abc{{ end }}", ERR_TEMPLATE_INVALID_SYNTAX);
 }
@@ -613,6 +681,135 @@ nutest_result template_block_non_executed(void) {
     return assert_eval_null("{{ if false }}{{ block `x` . -}} lol {{- end }}{{ end }}{{ template `x` . }}o", "lolo");
 }
 
+nutest_result template_template_forward(void) {
+    return assert_eval_null("{{ template `later` 3 }}{{ define `later` }}{{ . }}{{ end }}", "3");
+}
+
+nutest_result template_template_within_define(void) {
+    return assert_eval_null("{{ define `a` }}{{ template `b` . }}{{ end }}{{ define `b` }}{{ . }}{{ end }}{{ template `a` 6 }}", "6");
+}
+
+nutest_result template_non_executed_func_unknown(void) {
+    return assert_eval_err("{{ if false }}{{ nofunc }}{{ end }}", ERR_TEMPLATE_FUNC_UNKNOWN);
+}
+
+nutest_result template_non_executed_var_unknown(void) {
+    return assert_eval_err("{{ if false }}{{ $nope }}{{ end }}", ERR_TEMPLATE_VAR_UNKNOWN);
+}
+
+nutest_result template_compile_exec_twice(void) {
+    const char* tpl = "{{ range $i, $v := . }}{{ $i }}={{ $v }} {{ end }}";
+    stream st;
+    stream_open_memory(&st, tpl, strlen(tpl));
+    compiled_template compiled;
+    int err = template_compile(&st, &compiled);
+    stream_close(&st);
+    NUTEST_ASSERT(err == 0);
+    json_value val;
+    err = make_json_val(&val, "[4, 5]");
+    NUTEST_ASSERT(err == 0);
+    char* out;
+    err = template_exec(&compiled, &val, &out);
+    NUTEST_ASSERT(err == 0);
+    NUTEST_ASSERT(strcmp("0=4 1=5 ", out) == 0);
+    free(out);
+    json_value_free(&val);
+    err = make_json_val(&val, "{\"a\": true}");
+    NUTEST_ASSERT(err == 0);
+    err = template_exec(&compiled, &val, &out);
+    NUTEST_ASSERT(err == 0);
+    NUTEST_ASSERT(strcmp("a=true ", out) == 0);
+    free(out);
+    json_value_free(&val);
+    compiled_template_free(&compiled);
+    return NUTEST_PASS;
+}
+
+typedef struct {
+    buf out;
+    size_t calls;
+} sink_data;
+
+int sink_collect(const char* data, size_t len, void* userdata) {
+    sink_data* sink = userdata;
+    buf_append(&sink->out, data, len);
+    sink->calls++;
+    return 0;
+}
+
+int sink_fail(const char* data, size_t len, void* userdata) {
+    (void)data;
+    (void)len;
+    (void)userdata;
+    return -1;
+}
+
+nutest_result template_sink_chunks(void) {
+    const char* tpl = "{{ range 5000 }}a {{- ` b` }}{{ end }}";
+    stream st;
+    stream_open_memory(&st, tpl, strlen(tpl));
+    json_value val = JSON_NULL;
+    sink_data sink = {.calls = 0};
+    buf_init(&sink.out);
+    int err = template_eval_to_sink(&st, &val, sink_collect, &sink);
+    stream_close(&st);
+    NUTEST_ASSERT(err == 0);
+    NUTEST_ASSERT(sink.calls > 1);
+    NUTEST_ASSERT(sink.out.len == 15000);
+    NUTEST_ASSERT(memcmp(sink.out.data, "a ba b", 6) == 0);
+    buf_free(&sink.out);
+    return NUTEST_PASS;
+}
+
+nutest_result template_sink_write_err(void) {
+    const char* tpl = "abc";
+    stream st;
+    stream_open_memory(&st, tpl, strlen(tpl));
+    json_value val = JSON_NULL;
+    int err = template_eval_to_sink(&st, &val, sink_fail, NULL);
+    stream_close(&st);
+    NUTEST_ASSERT(err == -1);
+    return NUTEST_PASS;
+}
+
+nutest_result template_ctx_reuse(void) {
+    template_ctx ctx;
+    template_ctx_init(&ctx);
+    json_value val;
+    int err = make_json_val(&val, "[1, 2, 3]");
+    NUTEST_ASSERT(err == 0);
+    // more variables than the initial stack capacity
+    const char* many = "{{ $a := 1 }}{{ $b := 2 }}{{ $c := 3 }}{{ $d := 4 }}{{ $e := 5 }}"
+                       "{{ range $i, $v := . }}{{ $f := 6 }}{{ $g := 7 }}{{ $h := $v }}{{ $h }}{{ end }}{{ $e }}";
+    const char* out;
+    err = template_ctx_eval_mem(&ctx, many, strlen(many), &val, &out);
+    NUTEST_ASSERT(err == 0);
+    NUTEST_ASSERT(strcmp("1235", out) == 0);
+    err = template_ctx_eval_mem(&ctx, "{{ $x := 1 }}{{ $nope }}", 24, &val, &out);
+    NUTEST_ASSERT(err == ERR_TEMPLATE_VAR_UNKNOWN);
+    NUTEST_ASSERT(out == NULL);
+    err = template_ctx_eval_mem(&ctx, "{{ $y := len . }}{{ $y }}", 25, &val, &out);
+    NUTEST_ASSERT(err == 0);
+    NUTEST_ASSERT(strcmp("3", out) == 0);
+    sink_data sink = {.calls = 0};
+    buf_init(&sink.out);
+    stream st;
+    stream_open_memory(&st, many, strlen(many));
+    compiled_template compiled;
+    err = template_ctx_compile(&ctx, &st, &compiled);
+    stream_close(&st);
+    NUTEST_ASSERT(err == 0);
+    err = template_ctx_exec_to_sink(&ctx, &compiled, &val, sink_collect, &sink);
+    NUTEST_ASSERT(err == 0);
+    NUTEST_ASSERT(sink.out.len == 4);
+    NUTEST_ASSERT(memcmp("1235", sink.out.data, 4) == 0);
+    compiled_template_free(&compiled);
+    buf_free(&sink.out);
+    json_value_free(&val);
+    template_ctx_free(&ctx);
+    return NUTEST_PASS;
+}
+
 nutest_result template_slice_str_single_idx(void) {
     return assert_eval_null("{{ slice `zyx` 1 }}", "yx");
 }
@@ -813,6 +1010,10 @@ nutest_result template_printf_g(void) {
     return assert_eval_null("{{ printf `%g` 623.75 }}", "623.75");
 }
 
+nutest_result template_printf_g_shortest(void) {
+    return assert_eval_null("{{ printf `%g` 3.14159265358979 }}", "3.14159265358979");
+}
+
 nutest_result template_printf_q(void) {
     return assert_eval_null("{{ printf `%q` `a\"b` }}", "\"a\\\"b\"");
 }
@@ -841,6 +1042,10 @@ nutest_result template_printf_missing(void) {
     return assert_eval_null("{{ printf `%s` }}", "%!s(MISSING)");
 }
 
+nutest_result template_printf_many_args(void) {
+    return assert_eval_null("{{ printf `%v%v%v%v%v%v%v%v%v%v%v%v%v%v%v%v%v%v` 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 }}", "123456789012345678");
+}
+
 nutest_result template_printf_complex(void) {
     return assert_eval_data("{{ printf `%s` . }}", "[{\"a\":3.5}, {\"b\":true}, [false, null]]",
                             "[map[a:%!s(float64=3.5)] map[b:%!s(bool=true)] [%!s(bool=false) <nil>]]");
@@ -848,6 +1053,9 @@ nutest_result template_printf_complex(void) {
 
 int main() {
     nutest_register(template_identity);
+    nutest_register(template_identity_utf8);
+    nutest_register(template_text_invalid_utf8);
+    nutest_register(template_text_surrogate);
     nutest_register(template_empty_pipeline);
     nutest_register(template_incomplete_pipeline);
     nutest_register(template_incomplete_str);
@@ -862,12 +1070,17 @@ int main() {
     nutest_register(template_comment_post_content);
     nutest_register(template_print_positive_number);
     nutest_register(template_print_negative_number);
+    nutest_register(template_print_denormal_number);
     nutest_register(template_print_regular_str);
     nutest_register(template_print_backtick_str);
     nutest_register(template_print_list_elems);
+    nutest_register(template_print_numbers);
     nutest_register(template_print_list_empty);
     nutest_register(template_print_obj_elem);
     nutest_register(template_print_obj_elems);
+    nutest_register(template_print_obj_sorted);
+    nutest_register(template_var_nested_copy);
+    nutest_register(template_range_obj_nested);
     nutest_register(template_print_obj_empty);
     nutest_register(template_func_unknown);
     nutest_register(template_func_literal_bool);
@@ -931,10 +1144,14 @@ int main() {
     nutest_register(template_var_assign_undefined);
     nutest_register(template_var_redefine);
     nutest_register(template_var_scope_kept);
+    nutest_register(template_var_scope_assign);
     nutest_register(template_var_scope_lost);
     nutest_register(template_loop_var_value);
     nutest_register(template_loop_var_arr);
     nutest_register(template_loop_var_map);
+    nutest_register(template_loop_var_body_declare);
+    nutest_register(template_loop_var_assign_outer);
+    nutest_register(template_loop_var_reassign_iterable);
     nutest_register(template_loop_null_name);
     nutest_register(template_func_not_true);
     nutest_register(template_func_not_false);
@@ -974,6 +1191,7 @@ int main() {
     nutest_register(template_pipe_var_reassign);
     nutest_register(template_define_invoke);
     nutest_register(template_define_change_dot);
+    nutest_register(template_define_dollar);
     nutest_register(template_define_no_name);
     nutest_register(template_define_nested);
     nutest_register(template_template_no_val);
@@ -983,6 +1201,14 @@ int main() {
     nutest_register(template_block_no_name);
     nutest_register(template_block_no_val);
     nutest_register(template_block_non_executed);
+    nutest_register(template_template_forward);
+    nutest_register(template_template_within_define);
+    nutest_register(template_non_executed_func_unknown);
+    nutest_register(template_non_executed_var_unknown);
+    nutest_register(template_compile_exec_twice);
+    nutest_register(template_sink_chunks);
+    nutest_register(template_sink_write_err);
+    nutest_register(template_ctx_reuse);
     nutest_register(template_slice_str_single_idx);
     nutest_register(template_slice_str_two_idx);
     nutest_register(template_slice_str_three_idx);
@@ -1033,6 +1259,7 @@ int main() {
     nutest_register(template_printf_e);
     nutest_register(template_printf_f);
     nutest_register(template_printf_g);
+    nutest_register(template_printf_g_shortest);
     nutest_register(template_printf_q);
     nutest_register(template_printf_s);
     nutest_register(template_printf_t);
@@ -1041,5 +1268,6 @@ int main() {
     nutest_register(template_printf_x_str);
     nutest_register(template_printf_missing);
     nutest_register(template_printf_complex);
+    nutest_register(template_printf_many_args);
     return nutest_run();
 }